@@ -0,0 +1,183 @@
+/*
+ * config.c
+ *
+ *  Wear-leveled configuration records in EEPROM.
+ *
+ *  Record layout (21 bytes, one record per 32 byte EEPROM page so a record is written by one page write):
+ *    0      version		CONFIG_VERSION
+ *    1      seq			Sequence number, one more than the previous record (mod 256)
+ *    2      wait_minutes[0]
+ *    3      debounce_ms
+ *    4-13   windows_ms		Little endian
+ *    14     channel_mode
+ *    15     wait_minutes[1]
+ *    16-17  ramp_ms		Little endian
+ *    18-19  fade_ms		Little endian
+ *    20     crc			CRC-8 (polynomial 0x07) of bytes 0-19
+ *
+ *  The ring starts at the second EEPROM page, the first page still holds the wait minutes byte written
+ *  by older firmware at address 0. It is only read, as the wait time, when there is no valid record.
+ *
+ *  Records are read with plain loads from the memory mapped EEPROM, the NVM controller is only used to
+ *  write. The caller keeps the loaded config_t as the RAM shadow the rest of the firmware reads.
+ */
+#include "hal.h"
+#include "config.h"
+
+#define CONFIG_VERSION					2
+#define CONFIG_EEPROM_SIZE				512		// ATxmega8E5 EEPROM size
+#define CONFIG_LEGACY_ADDR				0x0000	// Wait minutes byte of older firmware
+#define CONFIG_RING_START				32		// Second EEPROM page
+#define CONFIG_RECORD_SIZE				21
+#define CONFIG_SLOT_SIZE				32		// One record per EEPROM page
+#define CONFIG_SLOTS					((CONFIG_EEPROM_SIZE - CONFIG_RING_START) / CONFIG_SLOT_SIZE)
+#define SLOT_ADDR(slot)					(CONFIG_RING_START + (uint16_t) (slot) * CONFIG_SLOT_SIZE)
+#define NO_SLOT							0xFF
+
+/*
+ * Global variables (Note best code optimization (code size) requires all defaults to be 0)
+ */
+uint8_t  config_slot = NO_SLOT;						// Slot of the newest valid record
+uint8_t  config_seq = 0;							// Sequence number of the newest valid record
+
+static const uint16_t default_windows[CONFIG_WINDOWS] HAL_FLASH = { 2000, 3000, 4000, 7000, 60000 };
+
+static uint8_t crc8(const uint8_t *data, uint8_t len)
+{
+	uint8_t crc = 0;
+	uint8_t bit;
+
+	while (len--)
+	{
+		crc ^= *data++;
+		for (bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+/*
+ * Return TRUE when the version and CRC of a record are good.
+ */
+static uint8_t record_valid(const uint8_t *record)
+{
+	return (record[0] == CONFIG_VERSION) && (crc8(record, CONFIG_RECORD_SIZE - 1) == record[CONFIG_RECORD_SIZE - 1]);
+}
+
+/*
+ * Return the slot of the newest valid record of the ring, NO_SLOT when there is none.
+ *  Only the version and sequence number of each slot are read to find the newest record, the full record
+ *  is read to check the CRC and the next older one is tried when it is bad.
+ */
+static uint8_t ring_newest(const uint8_t *ring)
+{
+	uint8_t tried[CONFIG_SLOTS];
+	uint8_t slot, best, seq, attempt;
+
+	for (slot = 0; slot < CONFIG_SLOTS; slot++)
+	{
+		tried[slot] = (ring[(uint16_t) slot * CONFIG_SLOT_SIZE] != CONFIG_VERSION);
+	}
+	for (attempt = 0; attempt < CONFIG_SLOTS; attempt++)
+	{
+		// Newest untried slot, the records of the ring span less than half the sequence numbers
+		best = NO_SLOT;
+		for (slot = 0; slot < CONFIG_SLOTS; slot++)
+		{
+			if (!tried[slot])
+			{
+				seq = ring[(uint16_t) slot * CONFIG_SLOT_SIZE + 1];
+				if ((best == NO_SLOT) || ((int8_t) (seq - config_seq) > 0))
+				{
+					best = slot;
+					config_seq = seq;
+				}
+			}
+		}
+		if (best == NO_SLOT)
+		{
+			break;
+		}
+		if (record_valid(&ring[(uint16_t) best * CONFIG_SLOT_SIZE]))
+		{
+			return best;
+		}
+		tried[best] = TRUE;
+	}
+	return NO_SLOT;
+}
+
+/*
+ * Load the newest valid record, or the defaults when there is none.
+ */
+void config_load(config_t *config)
+{
+	const uint8_t *ring = hal_nvm_map(CONFIG_RING_START);
+	const uint8_t *record;
+	uint8_t i;
+
+	config_slot = ring_newest(ring);
+	if (config_slot != NO_SLOT)
+	{
+		record = &ring[(uint16_t) config_slot * CONFIG_SLOT_SIZE];
+		config->wait_minutes[0] = record[2];
+		config->wait_minutes[1] = record[15];
+		config->debounce_ms = record[3];
+		for (i = 0; i < CONFIG_WINDOWS; i++)
+		{
+			config->windows_ms[i] = record[4 + 2 * i] | ((uint16_t) record[5 + 2 * i] << 8);
+		}
+		config->channel_mode = record[14];
+		config->ramp_ms = record[16] | ((uint16_t) record[17] << 8);
+		config->fade_ms = record[18] | ((uint16_t) record[19] << 8);
+		return;
+	}
+	// No valid record, use the defaults and the wait time of older firmware if it was programmed
+	config_seq = 0;
+	config->wait_minutes[0] = *hal_nvm_map(CONFIG_LEGACY_ADDR);
+	if ((config->wait_minutes[0] == 0) || (config->wait_minutes[0] == 0xFF))
+	{
+		config->wait_minutes[0] = CONFIG_WAIT_MINUTES;
+	}
+	config->wait_minutes[1] = config->wait_minutes[0];
+	config->debounce_ms = CONFIG_DEBOUNCE_MS;
+	for (i = 0; i < CONFIG_WINDOWS; i++)
+	{
+		config->windows_ms[i] = HAL_FLASH_WORD(&default_windows[i]);
+	}
+	config->channel_mode = CONFIG_CHANNEL_MODE;
+	config->ramp_ms = CONFIG_RAMP_MS;
+	config->fade_ms = CONFIG_FADE_MS;
+}
+
+/*
+ * Save the configuration as a new record in the slot after the newest one.
+ *  The write is queued, the record is valid once the EEPROM page write completes.
+ */
+void config_save(const config_t *config)
+{
+	uint8_t record[CONFIG_RECORD_SIZE];
+	uint8_t i;
+
+	config_slot = (config_slot == NO_SLOT) ? 0 : (config_slot + 1) % CONFIG_SLOTS;
+	config_seq++;
+	record[0] = CONFIG_VERSION;
+	record[1] = config_seq;
+	record[2] = config->wait_minutes[0];
+	record[3] = config->debounce_ms;
+	for (i = 0; i < CONFIG_WINDOWS; i++)
+	{
+		record[4 + 2 * i] = config->windows_ms[i] & 0xFF;
+		record[5 + 2 * i] = config->windows_ms[i] >> 8;
+	}
+	record[14] = config->channel_mode;
+	record[15] = config->wait_minutes[1];
+	record[16] = config->ramp_ms & 0xFF;
+	record[17] = config->ramp_ms >> 8;
+	record[18] = config->fade_ms & 0xFF;
+	record[19] = config->fade_ms >> 8;
+	record[20] = crc8(record, CONFIG_RECORD_SIZE - 1);
+	hal_nvm_write(SLOT_ADDR(config_slot), record, CONFIG_RECORD_SIZE);
+}
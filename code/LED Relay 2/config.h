@@ -0,0 +1,46 @@
+/*
+ * config.h
+ *
+ *  Configuration stored in EEPROM. Every save writes a new 16 byte record with a sequence number and a
+ *  CRC to the next slot of a ring, so the EEPROM wears evenly and a save cut short by a power loss only
+ *  loses that save.
+ */
+
+#ifndef CONFIG_H_
+#define CONFIG_H_
+
+#include <stdint.h>
+
+/*
+ * Configuration defaults
+ */
+#define CONFIG_WAIT_MINUTES				30		// Stay ON time
+#define CONFIG_DEBOUNCE_MS				50		// ACC de-bounce time
+#define CONFIG_RAMP_MS					200		// Output soft-start ramp time, used when the stored one is 0
+#define CONFIG_FADE_MS					2000	// Output fade out time at the end of Stay ON, used when the stored one is 0
+#define CONFIG_MODE_JOINT				0		// Both outputs follow ACC1 and ACC2 together
+#define CONFIG_MODE_INDEPENDENT			1		// ACC1 switches VOUT1 and ACC2 switches VOUT2, each with its own Stay ON
+#ifndef CONFIG_CHANNEL_MODE
+#define CONFIG_CHANNEL_MODE				CONFIG_MODE_JOINT	// Mode without a stored configuration
+#endif
+#define CONFIG_CHANNELS					2		// VOUT1 and VOUT2
+
+/*
+ * Sequence windows, the times in the StayON and Programming sequence tables
+ */
+enum CONFIG_WINDOW { CONFIG_WIN_2S = 0, CONFIG_WIN_3S, CONFIG_WIN_4S, CONFIG_WIN_7S, CONFIG_WIN_60S, CONFIG_WINDOWS };
+
+typedef struct
+{
+	uint8_t  wait_minutes[CONFIG_CHANNELS];		// Stay ON time of each channel in minutes, JOINT uses the first
+	uint8_t  debounce_ms;						// ACC de-bounce time in ms
+	uint16_t windows_ms[CONFIG_WINDOWS];		// Sequence windows in ms
+	uint8_t  channel_mode;						// CONFIG_MODE_JOINT or CONFIG_MODE_INDEPENDENT
+	uint16_t ramp_ms;							// Output soft-start ramp time in ms
+	uint16_t fade_ms;							// Output fade out time in ms
+} config_t;
+
+void config_load(config_t *config);
+void config_save(const config_t *config);
+
+#endif /* CONFIG_H_ */
@@ -0,0 +1,179 @@
+/*
+ * hal.h
+ *
+ *  Hardware Abstraction Layer for the LED Relay logic. The state machines in relay.c only reach the
+ *  hardware through these functions. hal_avr.c implements them for the ATxmega8E5 and ../host/hal_host.c
+ *  implements them for the host build.
+ */
+
+#ifndef HAL_H_
+#define HAL_H_
+
+#include <stdint.h>
+
+/*
+ * Common definitions
+ */
+#define FALSE							0
+#define TRUE							1
+#define OFF								FALSE
+#define ON								TRUE
+#define HAL_OUTPUT_V1					0x01
+#define HAL_OUTPUT_V2					0x02
+#define HAL_OUTPUT_FADE					0x40
+#define HAL_OUTPUT_FOLLOW				0x80
+#define HAL_NO_DEADLINE					0xFFFFFFFF
+#define HAL_TIMERS						2		// Stay ON timers, one per output
+#define HAL_CLOCK_SLOW_DIV				8		// System clock divider of hal_clock_slow()
+
+/*
+ * Build options
+ *  HAL_DEBOUNCE_FILTER de-bounces the ACC inputs in hardware instead of in the ISRs, an input is only
+ *  reported ON or OFF once it has been stable for the de-bounce time. Without it an OFF input is reported
+ *  ON at its first edge and OFF once it has been stable OFF for the de-bounce time.
+ */
+#ifndef HAL_DEBOUNCE_FILTER
+#define HAL_DEBOUNCE_FILTER				FALSE
+#endif
+/*
+ *  HAL_DEBOUNCE_VERTICAL de-bounces the ACC inputs by sampling their whole ports on a TCC4 tick, every pin
+ *  of a port at once with vertical counters. Like HAL_DEBOUNCE_FILTER an input is only reported once it
+ *  has read the same for the de-bounce time (4 samples). An edge only starts the sampling, so the cost
+ *  doesn't grow with the number of inputs and the TCC4 capture channels are left free.
+ */
+#ifndef HAL_DEBOUNCE_VERTICAL
+#define HAL_DEBOUNCE_VERTICAL			FALSE
+#endif
+#if HAL_DEBOUNCE_VERTICAL && HAL_DEBOUNCE_FILTER
+#error "HAL_DEBOUNCE_VERTICAL and HAL_DEBOUNCE_FILTER both de-bounce the ACC inputs"
+#endif
+/*
+ *  HAL_OUTPUT_XCL lets the XMega XCL lookup tables drive the outputs as ACC1 AND ACC2 whenever they are set
+ *  with HAL_OUTPUT_FOLLOW, so they follow the inputs without waiting for the relay logic. The lookup tables
+ *  use the filtered inputs so it needs HAL_DEBOUNCE_FILTER.
+ */
+#ifndef HAL_OUTPUT_XCL
+#define HAL_OUTPUT_XCL					FALSE
+#endif
+#if HAL_OUTPUT_XCL && !HAL_DEBOUNCE_FILTER
+#error "HAL_OUTPUT_XCL needs HAL_DEBOUNCE_FILTER, the outputs would follow the bouncing inputs"
+#endif
+/*
+ *  HAL_OUTPUT_RAMP turns the outputs ON with a PWM ramp (see hal_ramp_set()) to limit the inrush current
+ *  into the LED strips, and lets them fade out (see hal_fade_set()). The PWM uses the same pins as the XCL
+ *  lookup tables so it is on by default only without HAL_OUTPUT_XCL.
+ */
+#ifndef HAL_OUTPUT_RAMP
+#define HAL_OUTPUT_RAMP					!HAL_OUTPUT_XCL
+#endif
+#if HAL_OUTPUT_RAMP && HAL_OUTPUT_XCL
+#error "HAL_OUTPUT_RAMP and HAL_OUTPUT_XCL both drive V1EN and V2EN"
+#endif
+
+/*
+ * Constant tables
+ *  HAL_FLASH keeps a const table in flash instead of copying it to RAM, read it with HAL_FLASH_BYTE() and
+ *  HAL_FLASH_WORD().
+ */
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#define HAL_FLASH						PROGMEM
+#define HAL_FLASH_BYTE(addr)			pgm_read_byte(addr)
+#define HAL_FLASH_WORD(addr)			pgm_read_word(addr)
+#else
+#define HAL_FLASH
+#define HAL_FLASH_BYTE(addr)			(*(const uint8_t *) (addr))
+#define HAL_FLASH_WORD(addr)			(*(const uint16_t *) (addr))
+#endif
+
+/*
+ * Enumerations
+ */
+enum ACC_INPUT { ACC1_INPUT = 0, ACC2_INPUT, ACC_INPUTS };
+enum HAL_SLEEP { HAL_SLEEP_IDLE = 0, HAL_SLEEP_PSAVE, HAL_SLEEP_PDOWN };
+
+/*
+ * De-bounced ACC edge, produced by the HAL and consumed by the relay logic
+ */
+typedef struct
+{
+	uint8_t  input;								// ACC1_INPUT to ACC_INPUTS - 1
+	uint8_t  level;								// ON or OFF
+	uint32_t tick_ms;							// The ms timebase value when the edge occurred
+} acc_event_t;
+
+/*
+ * Initialization, clocks, IOs, timers and interrupts. Interrupts are enabled on return.
+ */
+void hal_init(void);
+
+/*
+ * Inputs
+ *  hal_input_get() returns the de-bounced state of an ACC input. hal_event_get() returns the next ACC
+ *  edge in the order they occurred, FALSE when there are none left. hal_debounce_set() changes the
+ *  de-bounce time (1 - 255 ms).
+ */
+uint8_t hal_input_get(uint8_t input);
+uint8_t hal_event_get(acc_event_t *event);
+void    hal_debounce_set(uint8_t ms);
+
+/*
+ * Outputs, any combination of HAL_OUTPUT_V1 and HAL_OUTPUT_V2 is ON, the rest is OFF
+ *  Adding HAL_OUTPUT_FOLLOW hands the outputs to the hardware with HAL_OUTPUT_XCL, they are ON while ACC1
+ *  and ACC2 are ON. Use it only when the relay logic would set them the same way, without HAL_OUTPUT_XCL
+ *  the V1 and V2 bits are used as is. With HAL_OUTPUT_RAMP an output turning ON ramps up over the time
+ *  set with hal_ramp_set() (0 - 2000 ms, 0 switches it ON at once). An output turning OFF with
+ *  HAL_OUTPUT_FADE dims down over the time set with hal_fade_set() (0 - 2000 ms) along a gamma curve, it
+ *  is OFF for hal_outputs_set() at once and hal_sleep() stays in Idle Mode until the fade is over. Any
+ *  other output turning OFF is immediate. Each output ramps and fades on its own, but the PWM has one
+ *  period for both, so an output that turns ON while the other one fades (or fades while the other one
+ *  ramps up) switches at once.
+ *  hal_outputs_wake() arms a fast path for the next hal_sleep() in Power-Save or Power-Down Mode, an ACC
+ *  edge that wakes the CPU with ACC1 and ACC2 both ON sets the outputs from the interrupt before the relay
+ *  logic runs. The relay logic must set the same outputs once it sees the inputs. Only without
+ *  HAL_DEBOUNCE_FILTER and HAL_DEBOUNCE_VERTICAL, where every edge is an ON input at once.
+ */
+void hal_outputs_set(uint8_t outputs);
+void hal_outputs_wake(uint8_t outputs);
+void hal_ramp_set(uint16_t ms);
+void hal_fade_set(uint16_t ms);
+
+/*
+ * Clock
+ *  hal_clock_ms() returns the 32-bit ms timebase. The Stay ON timers (0 to HAL_TIMERS - 1) run in
+ *  Power-Save mode, each on its own, and hal_timer_expired() returns TRUE once the time passed to
+ *  hal_timer_start() is over. An expired timer keeps hal_sleep() awake until it is stopped.
+ *  hal_clock_slow(TRUE) lets the system clock run divided by HAL_CLOCK_SLOW_DIV from the next hal_sleep()
+ *  on, while no ramp or fade needs the full speed. The ms timebase and the de-bounce time don't change.
+ *  hal_clock_slow(FALSE) is back to the full speed at once.
+ */
+uint32_t hal_clock_ms(void);
+void     hal_clock_slow(uint8_t slow);
+void     hal_timer_start(uint8_t timer, uint8_t minutes);
+void     hal_timer_stop(uint8_t timer);
+uint8_t  hal_timer_expired(uint8_t timer);
+
+/*
+ * Non-volatile configuration storage
+ *  hal_nvm_write() queues the bytes (less than 32) and returns, the EEPROM is written in the background
+ *  with as few page writes as possible. hal_nvm_map() waits for the queued writes to finish and returns
+ *  the EEPROM at addr in the data space, read it with plain loads until the next hal_nvm_write().
+ */
+const uint8_t *hal_nvm_map(uint16_t addr);
+void    hal_nvm_write(uint16_t addr, const uint8_t *data, uint8_t len);
+
+/*
+ * Sleep
+ *  Sleeps until an ACC edge, a Stay ON timer expiring or wait_ms passing. wait_ms is only supported in
+ *  HAL_SLEEP_IDLE, use HAL_NO_DEADLINE for the other modes.
+ */
+void hal_sleep(uint8_t mode, uint32_t wait_ms);
+
+/*
+ * Watchdog timer
+ */
+void hal_wdt_enable(void);
+void hal_wdt_disable(void);
+void hal_wdt_reset(void);
+
+#endif /* HAL_H_ */
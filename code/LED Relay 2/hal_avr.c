@@ -0,0 +1,1555 @@
+/*
+ * hal_avr.c
+ *
+ *  ATxmega8E5 implementation of the LED Relay HAL.
+ *
+ *  Any edge on ACC1 or ACC2 is routed through the event system to a TCC4 capture channel, so the ms
+ *  timebase is latched in hardware at the edge and the timestamp doesn't depend on interrupt latency. Each
+ *  capture resets the de-bounce timer of that input. Any time an edge occurs the input is considered ON
+ *  which will allow a noisy ON to be recognized as ON immediately. If the de-bounce timeout occurs then
+ *  either the input has stabilized ON or OFF and the de-bounce will evaluate the state. TCC4 only counts
+ *  while the CPU is active or in Idle Mode, the input sense interrupts wake it from the deeper modes.
+ *
+ *  With HAL_DEBOUNCE_FILTER the event channel digital filters de-bounce ACC1 and ACC2 instead, only an
+ *  input that has been stable for the de-bounce time gets through to the capture. A bouncing or noisy
+ *  input causes no interrupts at all while the CPU is active or in Idle Mode.
+ *
+ *  With HAL_DEBOUNCE_VERTICAL the first edge on a port masks the input sense interrupts and starts sampling
+ *  the ports with ACC inputs on TCC4-CCD. Every pin of a port is de-bounced at once by vertical counters,
+ *  the sampling stops and the interrupts are unmasked again once every pin is stable.
+ *
+ *  With HAL_OUTPUT_RAMP an output turning ON is driven by the TCD5 PWM, the EDMA copies the next duty from
+ *  a ramp table to the compare buffer at every TCD5 overflow so the CPU isn't involved until the ramp is
+ *  over and the port takes the pin back. A fade out works the same way with a gamma corrected table.
+ *
+ *  While the relay logic allows it the system clock is divided by HAL_CLOCK_SLOW_DIV, the TCC5 period and
+ *  the event filter prescaler follow so everything timed in ms stays the same.
+ *
+ *  Every peripheral is powered down in the PR registers unless some part of the HAL holds it, see
+ *  power_acquire(). The ms timebase lets go of TCC4, TCC5 and the event system in the deeper sleep modes.
+ * Author : Mike Lawrence
+ */
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <avr/xmega.h>
+#include "math.h"
+#include "hal.h"
+
+/*
+ * Fuse definitions
+ */
+FUSES =
+{
+	// FuseByte 1 = Watchdog timeouts set to 1,000 clocks or 1 s
+	.FUSEBYTE1 = 0xFF & (~NVM_FUSES_WDWP_gm | WDWP_1KCLK_gc) & (~NVM_FUSES_WDP_gm | WDP_1KCLK_gc),
+	// FuseByte 2 = Application reset vector enabled, BOD is sampled in Power Down Mode
+	.FUSEBYTE2 = 0xFF & (~NVM_FUSES_BOOTRST_bm | BOOTRST_APPLICATION_gc) & (~NVM_FUSES_BODPD_gm | BODPD_SAMPLED_gc),
+	// FuseByte 4 = Ext Reset is not disabled, Start Up Time is 0 ms, Watchdog timer is not locked
+	.FUSEBYTE4 = 0xFF & /* FUSE_RSTDISBL & */ (~NVM_FUSES_SUT_gm | SUT_0MS_gc) /* FUSE_WDLOCK */,
+	// FuseByte 5 = BOD continuous in Active Modes, EEPROM saved during chip erase, BOD Level is 2.0V
+	.FUSEBYTE5 = 0xFF & (~NVM_FUSES_BODACT_gm | BODACT_CONTINUOUS_gc) & FUSE_EESAVE & (~NVM_FUSES_BODLVL_gm | BODLVL_2V0_gc),
+	// FuseByte 5 = Timer fault and detection defaults
+	.FUSEBYTE6 = 0xFF,
+};
+
+/*
+ * Hardware specific definitions
+ */
+#define DEBOUNCE_TIME					0.050	// Until hal_debounce_set()
+#define WATCHDOG_TO						WDTO_2S
+#define V12EN_port						PORTD
+#define V1EN_bp							PIN4_bp
+#define V2EN_bp							PIN5_bp
+#define ACC1_port						PORTD
+#define ACC1_bp							PIN2_bp
+#define ACC1_PINS						(_BV(ACC1_bp) | _BV(PIN3_bp))	// ACC1_IN is wired to PD2 and PD3
+#define ACC1_EVMUX						EVSYS_CHMUX_PORTD_PIN2_gc	// ACC1 edges on Event Channel 0
+#define ACC2_port						PORTA
+#define ACC2_bp							PIN2_bp
+#define ACC2_PINS						_BV(ACC2_bp)
+#define ACC2_EVMUX						EVSYS_CHMUX_PORTA_PIN2_gc	// ACC2 edges on Event Channel 1
+#define FILTER_FAST_US					2048	// Digital filter sample time, 2 MHz / 4096
+#define FILTER_SLOW_US					16384	// Digital filter sample time, 2 MHz / 32768
+#define FILTER_MAX_SAMPLES				8
+#define VC_SAMPLES						4		// Equal samples in a row to change a vertical counter pin
+#define VC_PORTS						2		// Ports with ACC inputs
+#define CLK_PER_MS						2000	// System clock counts per ms at full speed
+#define CLOCK_SLOW_SHIFT				3		// log2(HAL_CLOCK_SLOW_DIV), one event filter prescaler step
+#if (1 << CLOCK_SLOW_SHIFT) != HAL_CLOCK_SLOW_DIV
+#error "CLOCK_SLOW_SHIFT does not match HAL_CLOCK_SLOW_DIV"
+#endif
+#define RAMP_STEPS						64		// PWM periods in a ramp or fade, one duty per period
+#define RAMP_MAX_MS						2000	// Longest ramp or fade, a PWM period must fit in TCD5
+#define XCL_FOLLOW						(XCL_LUTOUTEN_BOTH_gc | XCL_PORTSEL_PD_gc | XCL_LUTCONF_2LUT2IN_gc)
+#define XCL_RELEASE						(XCL_LUTOUTEN_DISABLE_gc | XCL_PORTSEL_PD_gc | XCL_LUTCONF_2LUT2IN_gc)
+/*
+ * Inferred definitions
+ */
+#define IS_ACC_ON(input)				(acc_pins[input].port->IN & acc_pins[input].mask)
+#define ACC_CAPTURE_IF(input)			(TC4_CCAIF_bm << (input))	// Capture flag of an input, CCA for ACC1
+#define MAIN_TCNT_FROM_SECONDS(sec)		(uint16_t) round(sec / 0.001)
+#define RTC_CNT_FROM_MINUTES(min)		(uint16_t) ((min) * 60)
+
+/*
+ * ACC input pins, indexed by ACC_INPUT
+ *  Input n is on Event Channel n and captured by TCC4 capture channel n (CCA, CCB). Everything else about
+ *  an input comes from this table, the ISRs of the capture and input sense interrupts only pass the input.
+ */
+typedef struct
+{
+	PORT_t  *port;								// Port of the input
+	uint8_t  mask;								// Pin sensed for the input
+	uint8_t  pins;								// Every pin wired to the input, configured the same way
+	uint8_t  evmux;								// Event Channel multiplexer setting of the sensed pin
+} acc_pin_t;
+
+static const acc_pin_t acc_pins[ACC_INPUTS] =
+{
+	{ &ACC1_port, _BV(ACC1_bp), ACC1_PINS, ACC1_EVMUX },
+	{ &ACC2_port, _BV(ACC2_bp), ACC2_PINS, ACC2_EVMUX },
+};
+
+/*
+ * Event Channel 2 ticks the ms timebase (TCC5 overflow) and TCC4 CCC times the main loop deadline, a
+ *  third input would land on both
+ */
+_Static_assert(ACC_INPUTS <= 2, "An ACC input needs its own Event Channel and TCC4 capture channel");
+
+/*
+ * Peripheral power, indexed by POWER_PERIPH
+ *  The power reduction bit of every peripheral the HAL uses. A peripheral is powered up while it has at
+ *  least one user, see power_acquire().
+ */
+enum POWER_PERIPH { POWER_TCC4 = 0, POWER_TCC5, POWER_EVSYS, POWER_RTC, POWER_EDMA, POWER_TCD5, POWER_XCL, POWER_PERIPHS };
+
+typedef struct
+{
+	register8_t *reg;							// PR register of the peripheral
+	uint8_t  mask;								// Power reduction bit
+} power_bit_t;
+
+static const power_bit_t power_bits[POWER_PERIPHS] =
+{
+	{ &PR.PRPC, _BV(PR_TC4_bp) },
+	{ &PR.PRPC, _BV(PR_TC5_bp) },
+	{ &PR.PRGEN, _BV(PR_EVSYS_bp) },
+	{ &PR.PRGEN, _BV(PR_RTC_bp) },
+	{ &PR.PRGEN, _BV(PR_EDMA_bp) },
+	{ &PR.PRPD, _BV(PR_TC5_bp) },
+	{ &PR.PRGEN, _BV(PR_XCL_bp) },
+};
+
+/*
+ * ACC edge event queue
+ *  Single producer (the ACC ISRs, which all run at high level and never nest) and single consumer (main).
+ *  Only the ISRs write event_head and only main writes event_tail, so main can drain the queue without
+ *  disabling interrupts.
+ */
+#define EVENT_QUEUE_SIZE				8		// Must be a power of 2
+
+/*
+ * Global variables (Note best code optimization (code size) requires all defaults to be 0)
+ */
+volatile uint8_t  timer_expired = 0;				// Bit per Stay ON timer that has expired
+volatile uint8_t  timer_running = 0;				// Bit per Stay ON timer that is running
+uint16_t timer_deadline[HAL_TIMERS];				// RTC count when each Stay ON timer expires
+volatile uint16_t tick_ovf_cnt = 0;					// Upper 16 bits of the ms timebase (TCC4 overflow count)
+uint8_t  power_users[POWER_PERIPHS];				// Users of each peripheral, powered down at 0
+uint8_t  timebase_on = 0;							// The ms timebase holds TCC4, TCC5 and the event system
+
+volatile acc_event_t event_queue[EVENT_QUEUE_SIZE];	// ACC edge events
+volatile uint8_t  event_head = 0;					// Next event to write (ISRs only)
+volatile uint8_t  event_tail = 0;					// Next event to read (main only)
+volatile uint8_t  event_overflow = 0;				// An event was dropped because the queue was full
+uint8_t  resync_input = 0;							// Next input to report after an overflow (main only)
+
+/*
+ * EEPROM write queue
+ *  hal_nvm_write() only queues its bytes, one entry per byte, and publishes them all at once. The EEPROM
+ *  Ready interrupt loads every queued byte of one page into the page buffer and starts the erase/write.
+ *  Single producer (main) and single consumer (the NVM ISR) like the event queue.
+ */
+#define NVM_QUEUE_SIZE					32		// Must be a power of 2
+typedef struct
+{
+	uint16_t addr;								// EEPROM address
+	uint8_t  value;								// Byte to write
+} nvm_write_t;
+
+volatile nvm_write_t nvm_queue[NVM_QUEUE_SIZE];		// Pending EEPROM writes
+volatile uint8_t  nvm_head = 0;						// Next write to queue (main only)
+volatile uint8_t  nvm_tail = 0;						// Next write to start (NVM ISR only)
+
+volatile uint8_t  acc_last[ACC_INPUTS];				// Last state of each ACC input (ISRs only)
+uint8_t  debounce_ticks = MAIN_TCNT_FROM_SECONDS(DEBOUNCE_TIME);	// De-bounce time in TCC4 counts
+#if HAL_DEBOUNCE_FILTER
+volatile uint16_t settle_end;						// TCC4 count when the filters have settled after an edge
+volatile uint8_t  settling = 0;						// An edge is still in the filters
+uint16_t settle_ticks;								// Longest time an edge stays in the filters
+#elif HAL_DEBOUNCE_VERTICAL
+/*
+ * Vertical counters
+ *  Bit n of ct1:ct0 is a 2-bit counter of pin n of the port. It counts the samples in a row that differ
+ *  from the de-bounced state down from 3 and is set back to 3 by a sample that doesn't, the pin changes
+ *  state when it wraps. Only the ISRs use them once hal_init() has set them up.
+ */
+typedef struct
+{
+	PORT_t  *port;								// Port sampled
+	uint8_t  mask;								// ACC pins of the port
+	uint8_t  state;								// De-bounced level of the pins
+	uint8_t  ct0;								// Low bit of each pin counter
+	uint8_t  ct1;								// High bit of each pin counter
+} vc_port_t;
+
+vc_port_t vc_ports[VC_PORTS] = { { &ACC1_port }, { &ACC2_port } };
+volatile uint8_t  vc_busy = 0;						// The ports are being sampled
+uint16_t vc_ticks = 1;								// Sample period in TCC4 counts
+#else
+volatile uint16_t debounce_end[ACC_INPUTS];		// TCC4 count when each de-bounce time is over (ISRs only)
+volatile uint8_t  debounce_busy = 0;				// Inputs with a de-bounce time running, bit per input (ISRs only)
+#endif
+uint8_t  clock_slow = 0;							// The relay logic allows the slow clock
+uint8_t  clock_shift = 0;							// The system clock is divided by 1 << clock_shift
+#if HAL_DEBOUNCE_FILTER
+uint8_t  filter_presc = EVSYS_PRESC_CLKPER_4096_gc;	// Event filter prescaler at full speed
+#endif
+volatile uint8_t  ramp_busy = 0;					// Pins of the outputs ramping or fading, TCD5 and the EDMA must keep running
+uint8_t  wake_outputs = 0;							// Outputs the input sense ISRs turn ON, see hal_outputs_wake()
+#if HAL_OUTPUT_RAMP
+volatile uint8_t  ramp_fading = 0;					// The running ramp is a fade out
+uint16_t ramp_table[RAMP_STEPS];					// TCD5 compare value of each ramp up step
+uint16_t fade_table[RAMP_STEPS];					// TCD5 compare value of each fade out step
+uint16_t ramp_per = 0;								// TCD5 period of a ramp, 0 when there is no ramp
+uint16_t fade_per = 0;								// TCD5 period of a fade, 0 when there is no fade
+
+/*
+ * Fade out brightness of each step, 255 * ((63 - step) / 63) ^ 2.2. Equal steps of perceived brightness
+ *  need the duty to fall fast at first and slowly near the end.
+ */
+static const uint8_t fade_gamma[RAMP_STEPS] HAL_FLASH =
+{
+	255, 246, 238, 229, 221, 213, 205, 197, 189, 182, 174, 167, 160, 153, 147, 140,
+	134, 128, 122, 116, 110, 105,  99,  94,  89,  84,  79,  74,  70,  66,  61,  57,
+	 54,  50,  46,  43,  40,  36,  33,  31,  28,  25,  23,  20,  18,  16,  14,  13,
+	 11,   9,   8,   7,   5,   4,   4,   3,   2,   1,   1,   1,   0,   0,   0,   0,
+};
+#endif
+
+/*
+ * Power up a peripheral for one more user.
+ *  The first user clears its power reduction bit, power_release() sets it again when the last user is
+ *  done. Must be called with interrupts disabled, the ISRs acquire and release peripherals too.
+ */
+static void power_acquire(uint8_t periph)
+{
+	if (!power_users[periph]++)
+	{
+		*power_bits[periph].reg &= ~power_bits[periph].mask;
+	}
+}
+
+/*
+ * Let go of a peripheral, it is powered down when nobody else uses it. Releasing one without users is
+ *  ignored, the count must not wrap and keep it from being powered up again. Must be called with
+ *  interrupts disabled.
+ */
+static void power_release(uint8_t periph)
+{
+	if (!power_users[periph])
+	{
+		return;
+	}
+	if (!--power_users[periph])
+	{
+		*power_bits[periph].reg |= power_bits[periph].mask;
+	}
+}
+
+/*
+ * Power the ms timebase (TCC5 ticking TCC4 through Event Channel 2) up or down.
+ *  Neither timer counts in the deeper sleep modes, hal_sleep() powers them down for the sleep and
+ *  whatever wakes the CPU powers them up again, TCC4 goes on from the count it stopped at. They stay up
+ *  while a TCC4 interrupt is pending, its flag couldn't be cleared with the clock stopped. Must be called
+ *  with interrupts disabled.
+ */
+static void timebase_power(uint8_t on)
+{
+	uint8_t enabled = (TCC4.INTCTRLA & TC_OVFINTLVL_gm) ? TC4_OVFIF_bm : 0;
+	uint8_t i;
+
+	if (on == timebase_on)
+	{
+		return;
+	}
+	if (on)
+	{
+		power_acquire(POWER_EVSYS);
+		power_acquire(POWER_TCC5);
+		power_acquire(POWER_TCC4);
+		TCC5.CTRLA = TC_CLKSEL_DIV1_gc;		// Source is System Clock
+		timebase_on = TRUE;
+		return;
+	}
+	TCC5.CTRLA = TC_CLKSEL_OFF_gc;			// TCC4 can't raise a flag after the check
+	for (i = 0; i < 4; i++)
+	{
+		// Interrupt level of CCA to CCD
+		if (TCC4.INTCTRLB & (TC_CCAINTLVL_gm << (2 * i)))
+		{
+			enabled |= TC4_CCAIF_bm << i;
+		}
+	}
+	if (TCC4.INTFLAGS & enabled)
+	{
+		TCC5.CTRLA = TC_CLKSEL_DIV1_gc;
+		return;
+	}
+	power_release(POWER_TCC4);
+	power_release(POWER_TCC5);
+	power_release(POWER_EVSYS);
+	timebase_on = FALSE;
+}
+
+/*
+ * Get the current value of the 32-bit ms timebase.
+ *  TCC4.CNT is the lower 16 bits and the TCC4 Overflow interrupt counts the upper 16 bits, so the
+ *  timebase wraps after 49.7 days instead of 65.5 seconds. Must be called with interrupts disabled
+ *  (from an ISR or between cli() and sei()).
+ */
+static uint32_t tick_get(void)
+{
+	uint16_t cnt = TCC4.CNT;
+	uint16_t ovf = tick_ovf_cnt;
+	// An overflow that is still pending belongs to this count if the count has already wrapped
+	if ((TCC4.INTFLAGS & TC4_OVFIF_bm) && !(cnt & 0x8000))
+	{
+		ovf++;
+	}
+	return ((uint32_t) ovf << 16) | cnt;
+}
+
+/*
+ * Extend a TCC4 count from the last 65.5 seconds (a capture or compare value) to the 32-bit ms timebase.
+ *  Must be called with interrupts disabled.
+ */
+static uint32_t tick_from_count(uint16_t cnt)
+{
+	uint32_t now = tick_get();
+
+	return now - (uint16_t) ((uint16_t) now - cnt);
+}
+
+/*
+ * Add an ACC edge event to the queue. Only called from the ACC ISRs.
+ */
+static void event_push(uint8_t input, uint8_t level, uint32_t tick_ms)
+{
+	uint8_t head = event_head;
+	uint8_t next = (head + 1) & (EVENT_QUEUE_SIZE - 1);
+
+	if (next == event_tail)
+	{
+		// Queue is full, hal_event_get() will resynchronize from acc_last
+		event_overflow = TRUE;
+		return;
+	}
+	event_queue[head].input = input;
+	event_queue[head].level = level;
+	event_queue[head].tick_ms = tick_ms;
+	// Publish the event only after it is completely written
+	event_head = next;
+}
+
+/*
+ * Divide the system clock by 1 << shift. TCC5 gets the period of 1 ms at the new clock and its count is
+ *  scaled at the same time, so the ms it is in keeps its length. Must be called with interrupts disabled.
+ */
+static void clock_apply(uint8_t shift)
+{
+	uint16_t cnt;
+
+	if (shift == clock_shift)
+	{
+		return;
+	}
+	cnt = TCC5.CNT;
+	_PROTECTED_WRITE(CLK.PSCTRL, shift ? CLK_PSADIV_8_gc : CLK_PSADIV_1_gc);
+	TCC5.PER = (CLK_PER_MS >> shift) - 1;
+	TCC5.CNT = (shift > clock_shift) ? (cnt >> shift) : (cnt << clock_shift);
+	clock_shift = shift;
+#if HAL_DEBOUNCE_FILTER
+	// One prescaler step less keeps the filter sample time
+	EVSYS.DFCTRL = EVSYS_PRESCFILT_CH04_gc | EVSYS_PRESCFILT_CH15_gc | EVSYS_FILSEL_PRESCALER_gc
+				 | (filter_presc - clock_shift / CLOCK_SLOW_SHIFT);
+#endif
+}
+
+#if HAL_DEBOUNCE_FILTER
+/*
+ * Handle a filtered ACC transition that occurred at TCC4 count cnt.
+ *  The filter only passes a level that has been stable for the de-bounce time, so the pin is still at the
+ *  new level. Only called from the ACC ISRs.
+ */
+static void acc_edge(uint8_t input, uint16_t cnt)
+{
+	uint8_t level = IS_ACC_ON(input) ? ON : OFF;
+
+	if (level != acc_last[input])
+	{
+		acc_last[input] = level;
+		event_push(input, level, tick_from_count(cnt));
+	}
+}
+
+/*
+ * Note an ACC edge that may still be in the filters.
+ *  The filters stop with the peripheral clock, hal_sleep() stays in Idle Mode until they have settled.
+ *  Called from the input sense ISRs and from hal_sleep() with interrupts disabled.
+ */
+static void acc_settle(void)
+{
+	uint8_t input;
+
+	for (input = ACC1_INPUT; input < ACC_INPUTS; input++)
+	{
+		acc_pins[input].port->INTFLAGS = acc_pins[input].mask;
+	}
+	settle_end = TCC4.CNT + settle_ticks;
+	settling = TRUE;
+}
+#elif HAL_DEBOUNCE_VERTICAL
+/*
+ * Start sampling the ports, the input sense interrupts stay masked until every pin is stable. Only called
+ *  from the input sense ISRs.
+ */
+static void vc_start(void)
+{
+	vc_port_t *p;
+
+	for (p = vc_ports; p < &vc_ports[VC_PORTS]; p++)
+	{
+		p->port->INTMASK &= ~p->mask;
+	}
+	if (!vc_busy)
+	{
+		vc_busy = TRUE;
+		TCC4.CCD = TCC4.CNT + vc_ticks;
+		TCC4.INTFLAGS = TC4_CCDIF_bm;
+		TCC4.INTCTRLB = (TCC4.INTCTRLB & ~TC4_CCDINTLVL_gm) | TC_CCDINTLVL_HI_gc;
+	}
+}
+
+/*
+ * Sample every port taken at TCC4 count cnt and report the inputs that changed. Returns TRUE while a pin is
+ *  still counting. Only called from the TCC4-CCD ISR.
+ */
+static uint8_t vc_sample(uint16_t cnt)
+{
+	vc_port_t *p;
+	uint8_t  busy = 0;
+	uint8_t  delta;
+	uint8_t  input;
+
+	for (p = vc_ports; p < &vc_ports[VC_PORTS]; p++)
+	{
+		// An edge from here on sets the input sense flag again, it restarts the sampling once unmasked
+		p->port->INTFLAGS = p->mask;
+		delta = (p->port->IN ^ p->state) & p->mask;
+		p->ct0 = ~(p->ct0 & delta);
+		p->ct1 = p->ct0 ^ (p->ct1 & delta);
+		delta &= p->ct0 & p->ct1;			// Pins whose counter wrapped
+		p->state ^= delta;
+		busy |= ~(p->ct0 & p->ct1) & p->mask;
+		if (!delta)
+		{
+			continue;
+		}
+		for (input = ACC1_INPUT; input < ACC_INPUTS; input++)
+		{
+			if ((acc_pins[input].port == p->port) && (delta & acc_pins[input].mask))
+			{
+				// The input has read the same since the first of the samples
+				acc_last[input] = (p->state & acc_pins[input].mask) ? ON : OFF;
+				event_push(input, acc_last[input], tick_from_count(cnt - (VC_SAMPLES - 1) * vc_ticks));
+			}
+		}
+	}
+	return busy;
+}
+#else
+/*
+ * Set TCC4-CCD to the first de-bounce time that is over, or disable it when none is running. Only called
+ *  from the ACC ISRs.
+ */
+static void debounce_schedule(void)
+{
+	uint16_t cnt = TCC4.CNT;
+	int16_t  left;
+	int16_t  first = INT16_MAX;
+	uint8_t  input;
+
+	for (input = ACC1_INPUT; input < ACC_INPUTS; input++)
+	{
+		if (debounce_busy & _BV(input))
+		{
+			left = (int16_t) (debounce_end[input] - cnt);
+			if (left < first)
+			{
+				first = left;
+			}
+		}
+	}
+	if (first == INT16_MAX)
+	{
+		// Both inputs are stable
+		TCC4.INTCTRLB &= ~TC4_CCDINTLVL_gm;
+		return;
+	}
+	if (first < 2)
+	{
+		// Already over, stay ahead of the count so the compare can't be missed
+		first = 2;
+	}
+	TCC4.CCD = cnt + first;
+	TCC4.INTFLAGS = TC4_CCDIF_bm;
+	TCC4.INTCTRLB = (TCC4.INTCTRLB & ~TC4_CCDINTLVL_gm) | TC_CCDINTLVL_HI_gc;
+}
+
+/*
+ * Handle an ACC edge that occurred at TCC4 count cnt.
+ *  Restarts the de-bounce timer of the input and reports it ON if it was OFF. Only called from the ACC ISRs.
+ */
+static void acc_edge(uint8_t input, uint16_t cnt)
+{
+	debounce_end[input] = cnt + debounce_ticks;
+	debounce_busy |= _BV(input);
+	debounce_schedule();
+	// Look for rising edge change
+	if (!acc_last[input])
+	{
+		// Input was low before now it has gone high
+		acc_last[input] = ON;
+		event_push(input, ON, tick_from_count(cnt));
+	}
+}
+
+/*
+ * Handle an input sense interrupt, TCC4 isn't counting so the edge time is the wake up time. Only called
+ *  from the input sense ISRs.
+ */
+static void acc_sense(uint8_t input)
+{
+	// Clear the interrupt flag
+	acc_pins[input].port->INTFLAGS = acc_pins[input].mask;
+	acc_edge(input, TCC4.CNT);
+}
+#endif
+
+#if HAL_OUTPUT_RAMP
+/*
+ * Stop the ramp or fade of the outputs in pins (V1EN and/or V2EN) and give them back to the port, TCD5 and
+ *  the EDMA stop with the last one. Called from main and the EDMA ISRs.
+ */
+static void ramp_stop(uint8_t pins)
+{
+	pins &= ramp_busy;
+	if (!pins)
+	{
+		return;
+	}
+	if (pins & _BV(V1EN_bp))
+	{
+		EDMA.CH0.CTRLA = 0;
+		TCD5.CTRLE &= ~TC45_CCAMODE_gm;		// Waveform output off, the port drives V1EN
+	}
+	if (pins & _BV(V2EN_bp))
+	{
+		EDMA.CH2.CTRLA = 0;
+		TCD5.CTRLE &= ~TC45_CCBMODE_gm;		// Waveform output off, the port drives V2EN
+	}
+	ramp_busy &= ~pins;
+	if (ramp_busy)
+	{
+		return;
+	}
+	TCD5.CTRLA = TC_CLKSEL_OFF_gc;
+	EDMA.CTRL = 0;
+	power_release(POWER_EDMA);
+	power_release(POWER_TCD5);
+	ramp_fading = FALSE;
+}
+
+/*
+ * Start ramping up (fade FALSE) or fading out (fade TRUE) the outputs in pins (V1EN and/or V2EN), their port
+ *  outputs are already set to the final level. Each output has its own EDMA channel and compare, so it
+ *  starts from the first step without touching the other one. TCD5 has one period for both outputs, an
+ *  output can't ramp while the other one fades (or the other way around), it is left to the port and
+ *  switches at once. The tables are filled by hal_ramp_set() and hal_fade_set(), starting takes no
+ *  arithmetic so the wake up fast path stays short. Never inlined, code/bench measures the wake up latency
+ *  up to its TCD5 start.
+ */
+static void __attribute__((noinline)) ramp_start(uint8_t pins, uint8_t fade)
+{
+	uint16_t per = fade ? fade_per : ramp_per;
+	uint16_t *table = fade ? fade_table : ramp_table;
+	uint8_t  idle = !ramp_busy;
+
+	clock_apply(0);							// The periods are for the full speed clock
+
+	if (!idle && (fade != ramp_fading))
+	{
+		return;
+	}
+	if (idle)
+	{
+		// Power up TCD5 and the EDMA
+		power_acquire(POWER_TCD5);
+		power_acquire(POWER_EDMA);
+		// Single slope PWM, the compares of the outputs are only enabled while they ramp
+		TCD5.CTRLB = TC45_WGMODE_SINGLESLOPE_gc;
+		TCD5.CNT = 0;
+		TCD5.PER = per - 1;
+		TCD5.CTRLE = 0;
+		// EDMA standard channels 0 and 2 copy the next step to CCABUF and CCBBUF at every overflow
+		EDMA.CTRL = EDMA_CHMODE_STD02_gc;
+		EDMA.CH0.DESTADDR = (uint16_t) &TCD5.CCABUF;
+		EDMA.CH2.DESTADDR = (uint16_t) &TCD5.CCBBUF;
+		EDMA.CH0.ADDRCTRL = EDMA.CH2.ADDRCTRL = EDMA_CH_RELOAD_NONE_gc | EDMA_CH_DIR_INC_gc;
+		EDMA.CH0.DESTADDRCTRL = EDMA.CH2.DESTADDRCTRL = EDMA_CH_DESTRELOAD_BURST_gc | EDMA_CH_DESTDIR_INC_gc;
+		EDMA.CH0.TRIGSRC = EDMA.CH2.TRIGSRC = EDMA_CH_TRIGSRC_TCD5_OVF_gc;
+		EDMA.CTRL |= EDMA_ENABLE_bm;
+		ramp_fading = fade;
+	}
+	// Each output starts at 0% duty for a ramp or 100% for a fade and gets the first step at the first
+	//  overflow, its EDMA channel copies the rest one overflow ahead and ends its ramp
+	if (pins & _BV(V1EN_bp))
+	{
+		TCD5.CCA = fade ? per : 0;
+		TCD5.CCABUF = table[0];
+		EDMA.CH0.ADDR = (uint16_t) &table[1];
+		EDMA.CH0.TRFCNT = sizeof(ramp_table) - sizeof(ramp_table[0]);
+		EDMA.CH0.CTRLB = EDMA_CH_TRNIF_bm | EDMA_CH_TRNINTLVL_HI_gc;
+		EDMA.CH0.CTRLA = EDMA_CH_ENABLE_bm | EDMA_CH_SINGLE_bm | EDMA_CH_BURSTLEN_bm;
+		TCD5.CTRLE |= TC45_CCAMODE_COMP_gc;	// OCA drives V1EN (PD4)
+	}
+	if (pins & _BV(V2EN_bp))
+	{
+		TCD5.CCB = fade ? per : 0;
+		TCD5.CCBBUF = table[0];
+		EDMA.CH2.ADDR = (uint16_t) &table[1];
+		EDMA.CH2.TRFCNT = sizeof(ramp_table) - sizeof(ramp_table[0]);
+		EDMA.CH2.CTRLB = EDMA_CH_TRNIF_bm | EDMA_CH_TRNINTLVL_HI_gc;
+		EDMA.CH2.CTRLA = EDMA_CH_ENABLE_bm | EDMA_CH_SINGLE_bm | EDMA_CH_BURSTLEN_bm;
+		TCD5.CTRLE |= TC45_CCBMODE_COMP_gc;	// OCB drives V2EN (PD5)
+	}
+	ramp_busy |= pins;
+	if (idle)
+	{
+		TCD5.CTRLA = TC_CLKSEL_DIV1_gc;		// Source is System Clock
+	}
+}
+#endif
+
+void hal_init(void)
+{
+	uint8_t input;
+#if HAL_DEBOUNCE_VERTICAL
+	vc_port_t *p;
+#endif
+
+	cli();									// Disable interrupts
+	// Clock defaults to internal 2MHz clock which is fine, but make sure 2MHz clock is ready before continuing
+	while (!(OSC.STATUS & OSC_RC2MRDY_bm));
+	// Initialize IOs, default all pins to input and have pull-ups enabled
+	PORTA.DIRCLR = 0xFF;											// PORTA is all inputs
+	PORTCFG.MPCMASK = 0xFF;
+	PORTA.PIN0CTRL = PORT_OPC_PULLDOWN_gc | PORT_ISC_BOTHEDGES_gc;	// PORTA is all pullups
+	PORTC.DIRCLR = 0xFF;											// PORTC is all inputs
+	PORTCFG.MPCMASK = 0xFF;
+	PORTC.PIN0CTRL = PORT_OPC_PULLDOWN_gc | PORT_ISC_BOTHEDGES_gc;	// PORTC is all pullups
+	PORTD.DIRCLR = 0xFF;											// PORTD is all inputs
+	PORTCFG.MPCMASK = 0xFF;
+	PORTD.PIN0CTRL = PORT_OPC_PULLDOWN_gc | PORT_ISC_BOTHEDGES_gc;	// PORTD is all pullups
+	PORTR.DIRCLR = 0xFF;											// PORTR is all inputs
+	PORTCFG.MPCMASK = 0xFF;
+	PORTR.PIN0CTRL = PORT_OPC_PULLDOWN_gc | PORT_ISC_BOTHEDGES_gc;	// PORTR is all pullups
+	// Configure the ACC inputs
+	for (input = ACC1_INPUT; input < ACC_INPUTS; input++)
+	{
+		PORTCFG.MPCMASK = acc_pins[input].pins;
+		acc_pins[input].port->PIN0CTRL = PORT_OPC_TOTEM_gc | PORT_ISC_BOTHEDGES_gc;	// Input NO pullup and interrupt on any edge
+		acc_pins[input].port->INTCTRL = PORT_INTLVL_HI_gc;						// Interrupt will be high level, hal_sleep() enables it
+	}
+	// Configure V1EN and V2EN as totem-pole outputs
+	V12EN_port.OUTCLR = _BV(V1EN_bp) | _BV(V2EN_bp);				// V1EN and V2EN will be low when enabled
+	PORTCFG.MPCMASK = _BV(V1EN_bp) | _BV(V2EN_bp);
+	V12EN_port.PIN0CTRL = PORT_OPC_TOTEM_gc;						// V1EN and V2EN will be totem-pole outputs
+	V12EN_port.DIRSET = _BV(V1EN_bp) | _BV(V2EN_bp);				// V1EN and V2EN are now outputs
+#ifdef NVM_EEMAPEN_bm
+	// Map the EEPROM into the data space (always mapped on devices without EEMAPEN)
+	NVM.CTRLB |= NVM_EEMAPEN_bm;
+#endif
+	// Configure Power Reduction, everything is powered down until power_acquire()
+	PR.PRGEN = 1 << PR_XCL_bp				// XCL power down: enabled
+			 | 1 << PR_RTC_bp				// RTC power down: enabled
+			 | 1 << PR_EVSYS_bp				// EVSYS power down: enabled
+			 | 1 << PR_EDMA_bp;				// EDMA power down: enabled
+	PR.PRPA = 1 << PR_DAC_bp				// DACA power down: enabled
+			| 1 << PR_ADC_bp				// ADCA power down: enabled
+			| 1 << PR_AC_bp;				// ACA power down: enabled
+	PR.PRPC = 1 << PR_TWI_bp				// TWIC power down: enabled
+			| 1 << PR_USART0_bp				// USART0C power down: enabled
+			| 1 << PR_SPI_bp				// SPIC power down: enabled
+			| 1 << PR_HIRES_bp				// HIRESC power down: enabled
+			| 1 << PR_TC5_bp				// TCC5 power down: enabled
+			| 1 << PR_TC4_bp;				// TCC4 power down: enabled
+	PR.PRPD = 1 << PR_USART0_bp				// USART0D power down: enabled
+			| 1 << PR_TC5_bp;				// TDC5 power down: enabled
+	timebase_power(TRUE);					// TCC4, TCC5 and EVSYS for the ms timebase
+#if HAL_OUTPUT_XCL
+	// The lookup tables drive the outputs from the ACC events in every sleep mode
+	power_acquire(POWER_XCL);
+	power_acquire(POWER_EVSYS);
+#endif
+	// Configure 1ms tick on TCC5
+	TCC5.PER = CLK_PER_MS - 1;				// 1 ms overflow at full speed
+	TCC5.CTRLA = TC_CLKSEL_DIV1_gc			// Source is System Clock
+			   | 0 << TC5_UPSTOP_bp			// Stop on Next Update: disabled
+			   | 0 << TC5_EVSTART_bp		// Start on Next Event: disabled
+			   | 0 << TC5_SYNCHEN_bp;		// Synchronization Enabled: disabled
+	// Configure Event Channel 2 for TCC5 overflow
+	EVSYS.CH2MUX = EVSYS_CHMUX_TCC5_OVF_gc; // Timer/Counter C5 Overflow
+	// Configure Event Channels 0 and 1 for ACC1 and ACC2 (the pins sense both edges), the XCL lookup table
+	//  event inputs are wired to these two channels
+	for (input = ACC1_INPUT; input < ACC_INPUTS; input++)
+	{
+		(&EVSYS.CH0MUX)[input] = acc_pins[input].evmux;
+	}
+#if HAL_DEBOUNCE_FILTER
+	hal_debounce_set(debounce_ticks);		// Digital filters for Event Channels 0 and 1
+#endif
+#if HAL_OUTPUT_XCL
+	// LUT0 is ACC1 AND ACC2 from Event Channels 0 and 1, LUT1 copies LUT0. LUT0 drives V1EN (PD4) and LUT1
+	//  drives V2EN (PD5) while hal_outputs_set() lets them. The events are asynchronous so the lookup
+	//  tables work in every sleep mode.
+	XCL.CTRLB = XCL_IN3SEL_XCL_gc			// LUT1 IN3: LUT0 output
+			  | XCL_IN2SEL_XCL_gc			// LUT1 IN2: LUT0 output
+			  | XCL_IN1SEL_EVSYS_gc			// LUT0 IN1: Event Channel 1 (ACC2)
+			  | XCL_IN0SEL_EVSYS_gc;		// LUT0 IN0: Event Channel 0 (ACC1)
+	XCL.CTRLC = XCL_EVASYNC0_bm | XCL_EVASYNC1_bm;	// Asynchronous event inputs
+	XCL.CTRLD = (0xA << XCL_TRUTH1_gp)		// LUT1 = IN2
+			  | (0x8 << XCL_TRUTH0_gp);		// LUT0 = IN0 AND IN1
+	XCL.CTRLA = XCL_RELEASE;				// The port drives the outputs until HAL_OUTPUT_FOLLOW
+#endif
+	// Configure main timer
+	TCC4.CTRLA = TC_CLKSEL_EVCH2_gc			// Event Channel 2
+			   | 0 << TC4_UPSTOP_bp			// Stop on Next Update: disabled
+			   | 0 << TC4_EVSTART_bp		// Start on Next Event: disabled
+			   | 0 << TC4_SYNCHEN_bp;		// Synchronization Enabled: disabled
+#if HAL_DEBOUNCE_VERTICAL
+	// CCA and CCB are not used, the ports are sampled instead
+	TCC4.CTRLE = TC45_CCCMODE_DISABLE_gc	// CCC: Main Loop Deadline compare, no output
+			   | TC45_CCDMODE_DISABLE_gc;	// CCD: ACC Sample Timer compare, no output
+#else
+	// CCA captures on Event Channel 0 (ACC1) and CCB on Event Channel 1 (ACC2)
+	TCC4.CTRLD = TC45_EVACT_OFF_gc			// No special event action, capture channels capture on their event
+			   | TC45_EVSEL_CH0_gc;			// CCA on Event Channel 0, CCB on Event Channel 1
+	TCC4.CTRLE = TC45_CCAMODE_CAPT_gc		// CCA: ACC1 Input Capture
+			   | TC45_CCBMODE_CAPT_gc		// CCB: ACC2 Input Capture
+			   | TC45_CCCMODE_DISABLE_gc	// CCC: Main Loop Deadline compare, no output
+			   | TC45_CCDMODE_DISABLE_gc;	// CCD: ACC De-bounce Timer compare, no output
+#endif
+	// Set interrupt level to high for TCC4 Overflow (upper 16 bits of the ms timebase)
+	TCC4.INTCTRLA = TC_ERRINTLVL_OFF_gc		// Error interrupt disabled
+				  | TC_OVFINTLVL_HI_gc;		// Overflow High level interrupt priority
+	// Set interrupt level to high for the TCC4-CCA and TCC4-CCB captures
+	TCC4.INTCTRLB = !HAL_DEBOUNCE_VERTICAL * TC_CCAINTLVL_HI_gc	// CCA High level interrupt priority
+				  | !HAL_DEBOUNCE_VERTICAL * TC_CCBINTLVL_HI_gc	// CCB High level interrupt priority
+				  | TC_CCCINTLVL_OFF_gc		// CCC interrupt disabled
+				  | TC_CCDINTLVL_OFF_gc;	// CCD interrupt disabled
+	// Enable high level interrupts
+	PMIC.CTRL = 0 << PMIC_RREN_bp			// Round-Robin Priority Enable: disabled
+			  | 0 << PMIC_IVSEL_bp			// Interrupt Vector Select: disabled
+			  | 1 << PMIC_HILVLEN_bp		// High Level Enable: enabled
+			  | 0 << PMIC_MEDLVLEN_bp		// Medium Level Enable: disabled
+			  | 0 << PMIC_LOLVLEN_bp;		// Low Level Enable: disabled
+	// Get the ACC inputs current state
+	for (input = ACC1_INPUT; input < ACC_INPUTS; input++)
+	{
+		acc_last[input] = IS_ACC_ON(input) ? ON : OFF;
+#if HAL_DEBOUNCE_VERTICAL
+		// Start the vertical counters of its port stable at the current level
+		for (p = vc_ports; p->port != acc_pins[input].port; p++);
+		p->mask |= acc_pins[input].mask;
+		p->state = p->port->IN & p->mask;
+		p->ct0 = p->ct1 = 0xFF;
+		p->port->INTFLAGS = acc_pins[input].mask;
+		p->port->INTMASK |= acc_pins[input].mask;	// The input sense interrupt starts the sampling
+#endif
+	}
+	// Enable global interrupts
+	sei();
+}
+
+uint8_t hal_input_get(uint8_t input)
+{
+	return acc_last[input];
+}
+
+uint8_t hal_event_get(acc_event_t *event)
+{
+	uint8_t tail = event_tail;
+
+	if (tail != event_head)
+	{
+		// Copy the oldest event, then hand its slot back to the ISRs
+		event->input = event_queue[tail].input;
+		event->level = event_queue[tail].level;
+		event->tick_ms = event_queue[tail].tick_ms;
+		event_tail = (tail + 1) & (EVENT_QUEUE_SIZE - 1);
+		return TRUE;
+	}
+	if (event_overflow)
+	{
+		// Events were lost, report the current ISR state of each input so main resynchronizes
+		cli();
+		event->input = resync_input;
+		event->level = acc_last[resync_input];
+		event->tick_ms = tick_get();
+		if (++resync_input >= ACC_INPUTS)
+		{
+			resync_input = ACC1_INPUT;
+			event_overflow = FALSE;
+		}
+		sei();
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Set the de-bounce time.
+ *  With HAL_DEBOUNCE_FILTER the time is rounded to 1 - 8 filter samples, 2 ms samples up to 16 ms and
+ *  16 ms samples above (up to 131 ms). With HAL_DEBOUNCE_VERTICAL it is rounded to a multiple of 4 ms.
+ */
+void hal_debounce_set(uint8_t ms)
+{
+#if HAL_DEBOUNCE_FILTER
+	uint8_t  presc = EVSYS_PRESC_CLKPER_4096_gc;
+	uint16_t sample_us = FILTER_FAST_US;
+	uint16_t samples;
+	uint8_t  input;
+
+	if (ms > FILTER_MAX_SAMPLES * FILTER_FAST_US / 1000)
+	{
+		presc = EVSYS_PRESC_CLKPER_32768_gc;
+		sample_us = FILTER_SLOW_US;
+	}
+	samples = ((uint32_t) ms * 1000 + sample_us / 2) / sample_us;
+	if (samples < 1)
+	{
+		samples = 1;
+	}
+	else if (samples > FILTER_MAX_SAMPLES)
+	{
+		samples = FILTER_MAX_SAMPLES;
+	}
+	// Prescaled filter clock on Event Channels 0 and 1, the input must be stable for samples clocks
+	filter_presc = presc;
+	EVSYS.DFCTRL = EVSYS_PRESCFILT_CH04_gc | EVSYS_PRESCFILT_CH15_gc | EVSYS_FILSEL_PRESCALER_gc
+				 | (presc - clock_shift / CLOCK_SLOW_SHIFT);
+	for (input = ACC1_INPUT; input < ACC_INPUTS; input++)
+	{
+		(&EVSYS.CH0CTRL)[input] = (samples - 1) << EVSYS_DIGFILT_gp;
+	}
+	// One more sample for the prescaler phase, rounded up to the next ms
+	settle_ticks = ((uint32_t) (samples + 1) * sample_us + 999) / 1000;
+#elif HAL_DEBOUNCE_VERTICAL
+	// The de-bounce time is VC_SAMPLES sample periods of at least 1 ms
+	vc_ticks = (ms + VC_SAMPLES / 2) / VC_SAMPLES;
+	if (vc_ticks < 1)
+	{
+		vc_ticks = 1;
+	}
+#endif
+	debounce_ticks = ms;					// TCC4 counts ms
+}
+
+#if HAL_OUTPUT_RAMP
+/*
+ * Return the TCD5 period that makes RAMP_STEPS periods last ms.
+ */
+static uint16_t ramp_period(uint16_t ms)
+{
+	if (ms > RAMP_MAX_MS)
+	{
+		ms = RAMP_MAX_MS;
+	}
+	return (uint32_t) ms * CLK_PER_MS / RAMP_STEPS;
+}
+#endif
+
+/*
+ * Set the soft-start ramp time, a ramp up is linear and ends at 100% (a compare above the period keeps the
+ *  output set).
+ */
+void hal_ramp_set(uint16_t ms)
+{
+#if HAL_OUTPUT_RAMP
+	uint8_t i;
+
+	ramp_per = ramp_period(ms);
+	for (i = 0; i < RAMP_STEPS; i++)
+	{
+		ramp_table[i] = ((uint32_t) ramp_per * (i + 1)) / RAMP_STEPS;
+	}
+#else
+	(void) ms;
+#endif
+}
+
+/*
+ * Set the fade out time, a fade out follows the gamma table down to 0%.
+ */
+void hal_fade_set(uint16_t ms)
+{
+#if HAL_OUTPUT_RAMP
+	uint8_t i;
+
+	fade_per = ramp_period(ms);
+	for (i = 0; i < RAMP_STEPS; i++)
+	{
+		fade_table[i] = ((uint32_t) fade_per * HAL_FLASH_BYTE(&fade_gamma[i])) >> 8;
+	}
+#else
+	(void) ms;
+#endif
+}
+
+/*
+ * Set the outputs, see hal_outputs_set(). Must be called with interrupts disabled, the EDMA interrupt may
+ *  end a ramp and the input sense ISRs set the outputs on the wake up fast path.
+ */
+static void outputs_apply(uint8_t outputs)
+{
+	uint8_t pins = 0;
+#if HAL_OUTPUT_RAMP
+	uint8_t start;
+	uint8_t stop;
+#endif
+
+	if (outputs & HAL_OUTPUT_V1)
+	{
+		pins |= _BV(V1EN_bp);
+	}
+	if (outputs & HAL_OUTPUT_V2)
+	{
+		pins |= _BV(V2EN_bp);
+	}
+#if HAL_OUTPUT_RAMP
+	start = pins & ~V12EN_port.OUT;			// Outputs turning ON, a fading one is already OFF in the port
+	stop = ~pins & V12EN_port.OUT & (_BV(V1EN_bp) | _BV(V2EN_bp));	// Outputs turning OFF
+	// An output that changes leaves its ramp or fade at once, the other one keeps running
+	ramp_stop(start | stop);
+	if (stop && (outputs & HAL_OUTPUT_FADE) && fade_per)
+	{
+		ramp_start(stop, TRUE);				// Fade out whatever was ON
+	}
+	if (start && ramp_per)
+	{
+		ramp_start(start, FALSE);
+	}
+#endif
+	V12EN_port.OUTCLR = ~pins & (_BV(V1EN_bp) | _BV(V2EN_bp));
+	V12EN_port.OUTSET = pins;
+#if HAL_OUTPUT_XCL
+	// Hand the pins to the lookup tables or take them back, the port already has the same levels
+	XCL.CTRLA = (outputs & HAL_OUTPUT_FOLLOW) ? XCL_FOLLOW : XCL_RELEASE;
+#endif
+}
+
+void hal_outputs_set(uint8_t outputs)
+{
+	cli();
+	outputs_apply(outputs);
+	sei();
+}
+
+/*
+ * Arm the wake up fast path for the next hal_sleep(), see acc_wake().
+ */
+void hal_outputs_wake(uint8_t outputs)
+{
+	wake_outputs = outputs;
+}
+
+#if !HAL_DEBOUNCE_FILTER && !HAL_DEBOUNCE_VERTICAL
+/*
+ * Wake up fast path, turn the armed outputs ON as soon as ACC1 and ACC2 are both ON instead of waiting for
+ *  the relay logic to see the edge. Every edge counts as ON at once in this mode, so the relay logic is
+ *  bound to turn the same outputs ON. Only called from the input sense ISRs.
+ */
+static void acc_wake(void)
+{
+	uint8_t input;
+
+	if (!wake_outputs)
+	{
+		return;
+	}
+	for (input = ACC1_INPUT; input < ACC_INPUTS; input++)
+	{
+		if (!IS_ACC_ON(input))
+		{
+			return;
+		}
+	}
+	outputs_apply(wake_outputs);
+	wake_outputs = 0;
+}
+#endif
+
+/*
+ * Allow or forbid the slow clock, see clock_apply().
+ */
+void hal_clock_slow(uint8_t slow)
+{
+	clock_slow = slow;
+	if (!slow)
+	{
+		cli();
+		clock_apply(0);
+		sei();
+	}
+}
+
+uint32_t hal_clock_ms(void)
+{
+	uint32_t tick_ms;
+
+	cli();									// Disable interrupts before grabbing the timebase
+	tick_ms = tick_get();
+	sei();									// Enable interrupts
+	return tick_ms;
+}
+
+/*
+ * Expire every Stay ON timer whose deadline has passed and set the RTC compare to the earliest deadline of
+ *  the ones still running, the compare interrupt is disabled when there is none. A deadline that is due
+ *  while the compare is being moved is expired here, clearing the compare flag must not lose it. Only
+ *  called with interrupts disabled or from the RTC ISR.
+ */
+static void timer_schedule(void)
+{
+	uint8_t  pending;
+	uint16_t now;
+	uint16_t left;
+	uint8_t  i;
+
+	RTC.INTCTRL = RTC_COMPINTLVL_OFF_gc | RTC_OVFINTLVL_OFF_gc;
+	do
+	{
+		now = RTC.CNT;
+		for (i = 0; i < HAL_TIMERS; i++)
+		{
+			// Deadlines are less than half the count ahead, so a passed one is less than half behind
+			if ((timer_running & _BV(i)) && ((uint16_t) (now - timer_deadline[i]) < 0x8000))
+			{
+				timer_expired |= _BV(i);		// Stay ON time is over
+			}
+		}
+		pending = timer_running & ~timer_expired;
+		if (!pending)
+		{
+			return;
+		}
+		left = 0xFFFF;
+		for (i = 0; i < HAL_TIMERS; i++)
+		{
+			if ((pending & _BV(i)) && ((uint16_t) (timer_deadline[i] - now) < left))
+			{
+				left = timer_deadline[i] - now;
+			}
+		}
+		while (RTC.STATUS & RTC_SYNCBUSY_bm);
+		RTC.COMP = now + left;
+		RTC.INTFLAGS = RTC_COMPIF_bm;				// Clear any stale interrupt flag
+		// The count may have reached the compare meanwhile, then expire it on the next pass
+	} while ((uint16_t) (RTC.CNT - now) >= left);
+	RTC.INTCTRL = RTC_COMPINTLVL_HI_gc				// Compare High level interrupt priority
+				| RTC_OVFINTLVL_OFF_gc;				// Overflow interrupt disabled
+}
+
+/*
+ * Start a Stay ON timer.
+ *  The RTC runs from the 1.024 kHz output of the internal 32.768 kHz RC oscillator prescaled to 1 count
+ *  per second. It runs free while any timer is running and each timer keeps its deadline as an RTC count.
+ *  The compare is always at the earliest deadline, so the part can stay in Power-Save mode for the whole
+ *  Stay ON time. Any uint8_t minutes fits in half the 16-bit count (255 * 60 = 15300).
+ */
+void hal_timer_start(uint8_t timer, uint8_t minutes)
+{
+	if (!timer_running)
+	{
+		// Start the 32.768 kHz internal RC oscillator and wait for it to be ready
+		OSC.CTRL |= OSC_RC32KEN_bm;
+		while (!(OSC.STATUS & OSC_RC32KRDY_bm));
+		// RTC clock source is 1.024 kHz from 32.768 kHz internal RC oscillator
+		CLK.RTCCTRL = CLK_RTCSRC_RCOSC_gc | CLK_RTCEN_bm;
+		// Power up the RTC
+		cli();
+		power_acquire(POWER_RTC);
+		sei();
+		while (RTC.STATUS & RTC_SYNCBUSY_bm);
+		RTC.CNT = 0;
+		RTC.PER = 0xFFFF;
+		RTC.INTFLAGS = RTC_COMPIF_bm | RTC_OVFIF_bm;	// Clear any stale interrupt flags
+		// Start the RTC, 1.024 kHz / 1024 is 1 count per second
+		while (RTC.STATUS & RTC_SYNCBUSY_bm);
+		RTC.CTRL = RTC_PRESCALER_DIV1024_gc;
+	}
+	cli();									// The RTC ISR may be rescheduling meanwhile
+	timer_deadline[timer] = RTC.CNT + RTC_CNT_FROM_MINUTES(minutes);
+	timer_running |= _BV(timer);
+	timer_expired &= ~_BV(timer);
+	timer_schedule();
+	sei();
+}
+
+/*
+ * Stop a Stay ON timer and clear its timeout, nothing to do when it isn't running.
+ *  With no timer left running the RTC and the 32.768 kHz internal RC oscillator are powered down again.
+ */
+void hal_timer_stop(uint8_t timer)
+{
+	if (!(timer_running & _BV(timer)))
+	{
+		// Only the last running timer stopping releases the RTC, see hal_timer_start()
+		return;
+	}
+	cli();
+	timer_running &= ~_BV(timer);
+	// The timeout has been handled, it must not keep hal_sleep() awake
+	timer_expired &= ~_BV(timer);
+	timer_schedule();
+	sei();
+	if (!timer_running)
+	{
+		// Stop the RTC
+		while (RTC.STATUS & RTC_SYNCBUSY_bm);
+		RTC.CTRL = RTC_PRESCALER_OFF_gc;
+		while (RTC.STATUS & RTC_SYNCBUSY_bm);
+		// Power down the RTC, its clock source and the oscillator
+		cli();
+		power_release(POWER_RTC);
+		sei();
+		CLK.RTCCTRL = 0;
+		OSC.CTRL &= ~OSC_RC32KEN_bm;
+	}
+}
+
+uint8_t hal_timer_expired(uint8_t timer)
+{
+	return (timer_expired >> timer) & 1;
+}
+
+/*
+ * Return the EEPROM at addr in the data space once every queued write has finished.
+ */
+const uint8_t *hal_nvm_map(uint16_t addr)
+{
+	while ((nvm_head != nvm_tail) || (NVM.STATUS & NVM_NVMBUSY_bm));
+	return (const uint8_t *) (MAPPED_EEPROM_START + addr);
+}
+
+/*
+ * Queue an EEPROM write, returns without waiting for the EEPROM.
+ *  Only waits when the queue is too full, the NVM ISR frees entries every page write (about 4 ms).
+ */
+void hal_nvm_write(uint16_t addr, const uint8_t *data, uint8_t len)
+{
+	uint8_t head;
+
+	while (((nvm_tail - nvm_head - 1) & (NVM_QUEUE_SIZE - 1)) < len);
+	head = nvm_head;
+	while (len--)
+	{
+		nvm_queue[head].addr = addr++;
+		nvm_queue[head].value = *data++;
+		head = (head + 1) & (NVM_QUEUE_SIZE - 1);
+	}
+	// Publish all the bytes at once so the NVM ISR writes a page with a single erase/write
+	nvm_head = head;
+	// EEPROM Ready interrupt starts the write as soon as the NVM controller is free
+	NVM.INTCTRL = NVM_EELVL_HI_gc;
+}
+
+/*
+ * Sleep until an interrupt occurs or wait_ms has passed.
+ *  Interrupts stay disabled from the final check for pending events until the sleep instruction, so an
+ *  ACC edge or Stay ON timeout can't slip in between the check and the sleep. The wait_ms wake up uses
+ *  TCC4-CCC so it only works in Idle Mode. TCC4 doesn't count in the other modes, so the input sense
+ *  interrupts are enabled to wake up on an ACC edge instead of the captures.
+ */
+void hal_sleep(uint8_t mode, uint32_t wait_ms)
+{
+	uint8_t deep = FALSE;
+	uint8_t sense = FALSE;
+	uint8_t capture = 0;
+	uint8_t input;
+#if HAL_DEBOUNCE_FILTER
+	int16_t left;
+#endif
+
+	if (wait_ms < 2)
+	{
+		// Deadline is too close to set a compare for it, don't sleep
+		return;
+	}
+	switch (mode)
+	{
+	case HAL_SLEEP_PSAVE:
+		set_sleep_mode(SLEEP_SMODE_PSAVE_gc);
+		break;
+	case HAL_SLEEP_PDOWN:
+		set_sleep_mode(SLEEP_SMODE_PDOWN_gc);
+		break;
+	default:
+		set_sleep_mode(SLEEP_SMODE_IDLE_gc);
+		break;
+	}
+	cli();
+	// Sleep and wake up on the slow clock when allowed, a ramp or fade needs the full speed until it is over
+	//  and the wake up fast path from the deeper modes should not wait for the slow clock
+	clock_apply((clock_slow && !ramp_busy && (mode == HAL_SLEEP_IDLE)) ? CLOCK_SLOW_SHIFT : 0);
+#if HAL_DEBOUNCE_FILTER
+	if (mode != HAL_SLEEP_IDLE)
+	{
+		for (input = ACC1_INPUT; input < ACC_INPUTS; input++)
+		{
+			if (acc_pins[input].port->INTFLAGS & acc_pins[input].mask)
+			{
+				// ACC edge since the last look
+				acc_settle();
+			}
+		}
+		left = (int16_t) (settle_end - TCC4.CNT);
+		if (settling && (left > 0))
+		{
+			// The filters stop in the deeper modes, stay in Idle Mode until they have passed or dropped the edge
+			mode = HAL_SLEEP_IDLE;
+			set_sleep_mode(SLEEP_SMODE_IDLE_gc);
+			wait_ms = (left < 2) ? 2 : left;
+		}
+		else
+		{
+			settling = FALSE;
+		}
+	}
+#elif HAL_DEBOUNCE_VERTICAL
+	if (vc_busy)
+	{
+		// TCC4 stops in the deeper modes, stay in Idle Mode until every pin is stable
+		mode = HAL_SLEEP_IDLE;
+		set_sleep_mode(SLEEP_SMODE_IDLE_gc);
+	}
+#else
+	if (debounce_busy)
+	{
+		// TCC4 stops in the deeper modes, stay in Idle Mode until the de-bounce times are over
+		mode = HAL_SLEEP_IDLE;
+		set_sleep_mode(SLEEP_SMODE_IDLE_gc);
+	}
+#endif
+	if (wait_ms <= 0xFFFF)
+	{
+		// TCC4-CCC interrupt wakes us up at the deadline
+		TCC4.INTFLAGS = TC4_CCCIF_bm;
+		TCC4.CCC = TCC4.CNT + (uint16_t) wait_ms;
+		TCC4.INTCTRLB = (TCC4.INTCTRLB & ~TC4_CCCINTLVL_gm) | TC_CCCINTLVL_HI_gc;
+	}
+	if ((mode != HAL_SLEEP_IDLE) && ((nvm_head != nvm_tail) || (NVM.STATUS & NVM_NVMBUSY_bm) || ramp_busy))
+	{
+		// EEPROM write, ramp or fade in progress, Idle Mode until the EEPROM Ready or EDMA interrupt is done
+		set_sleep_mode(SLEEP_SMODE_IDLE_gc);
+	}
+	else if (mode != HAL_SLEEP_IDLE)
+	{
+		deep = TRUE;
+#if !HAL_DEBOUNCE_VERTICAL
+		// With HAL_DEBOUNCE_VERTICAL the input sense interrupts are already enabled while the pins are stable
+		sense = TRUE;
+		for (input = ACC1_INPUT; input < ACC_INPUTS; input++)
+		{
+#if !HAL_DEBOUNCE_FILTER
+			// An edge before this point has been captured, an edge after it sets the input sense flag
+			acc_pins[input].port->INTFLAGS = acc_pins[input].mask;
+#endif
+			acc_pins[input].port->INTMASK |= acc_pins[input].mask;
+		}
+#endif
+	}
+#if !HAL_DEBOUNCE_VERTICAL
+	for (input = ACC1_INPUT; input < ACC_INPUTS; input++)
+	{
+		capture |= ACC_CAPTURE_IF(input);
+	}
+#endif
+	if ((event_head == event_tail) && !event_overflow && !timer_expired && !(TCC4.INTFLAGS & capture))
+	{
+		if (deep)
+		{
+			// The timebase doesn't count in the deeper modes, power it down until the wake up
+			timebase_power(FALSE);
+		}
+		sleep_enable();
+		sei();								// Sleep is executed before any pending interrupt
+		sleep_cpu();
+		sleep_disable();
+	}
+	cli();
+	// A Stay ON timeout wakes the CPU without powering up the timebase
+	timebase_power(TRUE);
+	wake_outputs = 0;						// The fast path is only armed for this sleep
+	if (sense)
+	{
+		// TCC4 is counting again, back to the captures
+		for (input = ACC1_INPUT; input < ACC_INPUTS; input++)
+		{
+			acc_pins[input].port->INTMASK &= ~acc_pins[input].mask;
+		}
+	}
+	sei();
+}
+
+void hal_wdt_enable(void)
+{
+	wdt_enable(WATCHDOG_TO);
+}
+
+void hal_wdt_disable(void)
+{
+	wdt_disable();
+}
+
+void hal_wdt_reset(void)
+{
+	wdt_reset();
+}
+
+/*
+ * PORTD Port Interrupt. (ACC1 Input Sense Interrupt)
+ *  Only enabled while sleeping in Power-Save or Power-Down Mode, where TCC4 doesn't count and can't
+ *  capture. Wakes the CPU on any ACC1 edge, the edge time is the wake up time. With HAL_DEBOUNCE_FILTER
+ *  it only wakes the CPU and the filtered edge is captured later. With HAL_DEBOUNCE_VERTICAL it is enabled
+ *  whenever the pins are stable and starts sampling them.
+ */
+ISR(PORTD_INT_vect)
+{
+	timebase_power(TRUE);					// The sleep may have powered it down
+#if HAL_DEBOUNCE_FILTER
+	// Clear the interrupt flag, the filter reports the edge once it has been stable
+	acc_settle();
+#elif HAL_DEBOUNCE_VERTICAL
+	// The sampling de-bounces every pin of the port, the edge only starts it
+	vc_start();
+#else
+	acc_wake();
+	acc_sense(ACC1_INPUT);
+#endif
+}
+
+/*
+ * PORTA Interrupt. (ACC2 Input Sense Interrupt)
+ *  Only enabled while sleeping in Power-Save or Power-Down Mode, where TCC4 doesn't count and can't
+ *  capture. Wakes the CPU on any ACC2 edge, the edge time is the wake up time. With HAL_DEBOUNCE_FILTER
+ *  it only wakes the CPU and the filtered edge is captured later. With HAL_DEBOUNCE_VERTICAL it is enabled
+ *  whenever the pins are stable and starts sampling them.
+ */
+ISR(PORTA_INT_vect)
+{
+	timebase_power(TRUE);					// The sleep may have powered it down
+#if HAL_DEBOUNCE_FILTER
+	// Clear the interrupt flag, the filter reports the edge once it has been stable
+	acc_settle();
+#elif HAL_DEBOUNCE_VERTICAL
+	// The sampling de-bounces every pin of the port, the edge only starts it
+	vc_start();
+#else
+	acc_wake();
+	acc_sense(ACC2_INPUT);
+#endif
+}
+
+#if !HAL_DEBOUNCE_VERTICAL
+/*
+ * Timer C4 Capture A interrupt (ACC1 Edge Capture)
+ *  Any edge on ACC1 latches the TCC4 count in CCA through Event Channel 0.
+ *  Handles ACC1 turning ON. Note ACC1 turning OFF is handled by the ACC De-bounce Timer, or here too
+ *  with HAL_DEBOUNCE_FILTER.
+ */
+ISR(TCC4_CCA_vect)
+{
+	// Reading the captured count clears the interrupt flag
+	acc_edge(ACC1_INPUT, TCC4.CCA);
+}
+
+/*
+ * Timer C4 Capture B interrupt (ACC2 Edge Capture)
+ *  Any edge on ACC2 latches the TCC4 count in CCB through Event Channel 1.
+ *  Handles ACC2 turning ON. Note ACC2 turning OFF is handled by the ACC De-bounce Timer, or here too
+ *  with HAL_DEBOUNCE_FILTER.
+ */
+ISR(TCC4_CCB_vect)
+{
+	// Reading the captured count clears the interrupt flag
+	acc_edge(ACC2_INPUT, TCC4.CCB);
+}
+#endif
+
+#if HAL_DEBOUNCE_VERTICAL
+/*
+ * Timer C4 Compare D interrupt (ACC Sample Timer)
+ *  Samples the ports every vc_ticks while a pin is counting, then hands the edges back to the input sense
+ *  interrupts.
+ */
+ISR(TCC4_CCD_vect)
+{
+	uint16_t cnt = TCC4.CCD;
+	vc_port_t *p;
+
+	if (vc_sample(cnt))
+	{
+		TCC4.CCD = cnt + vc_ticks;
+		return;
+	}
+	// Every pin is stable
+	vc_busy = FALSE;
+	TCC4.INTCTRLB &= ~TC4_CCDINTLVL_gm;
+	for (p = vc_ports; p < &vc_ports[VC_PORTS]; p++)
+	{
+		p->port->INTMASK |= p->mask;
+	}
+}
+#elif !HAL_DEBOUNCE_FILTER
+/*
+ * Timer C4 Compare D interrupt (ACC De-bounce Timer)
+ *  Used to handle ACC1 and ACC2 going stable. Occurs the de-bounce time after the last edge of either
+ *  input. Handles an input turning OFF. Note an input turning ON is handled by its edge capture.
+ */
+ISR(TCC4_CCD_vect)
+{
+	uint16_t cnt = TCC4.CNT;
+	uint8_t  input;
+
+	for (input = ACC1_INPUT; input < ACC_INPUTS; input++)
+	{
+		if ((debounce_busy & _BV(input)) && ((int16_t) (cnt - debounce_end[input]) >= 0))
+		{
+			// Input has stabilized, determine the new state
+			debounce_busy &= ~_BV(input);
+			if (acc_last[input] && !IS_ACC_ON(input))
+			{
+				// Input was previously ON and is now OFF
+				acc_last[input] = OFF;
+				event_push(input, OFF, tick_from_count(debounce_end[input]));
+			}
+		}
+	}
+	// Wait for the other input, if it is still bouncing
+	debounce_schedule();
+}
+#endif
+
+/*
+ * Timer C4 Overflow interrupt
+ *  Counts the upper 16 bits of the ms timebase.
+ */
+ISR(TCC4_OVF_vect)
+{
+	tick_ovf_cnt++;
+}
+
+/*
+ * Timer C4 Compare C interrupt (Main Loop Deadline)
+ *  Only wakes the CPU from Idle Mode, the main loop evaluates whatever timed out.
+ */
+ISR(TCC4_CCC_vect)
+{
+	// Disable the deadline interrupt, main sets it again before the next sleep
+	TCC4.INTCTRLB &= ~TC4_CCCINTLVL_gm;
+}
+
+/*
+ * NVM EEPROM Ready interrupt (EEPROM Write Queue)
+ *  Occurs whenever the NVM controller is not busy while enabled. Starts one page write with every queued
+ *  byte of the same page, or disables itself when the queue is empty.
+ */
+ISR(NVM_EE_vect)
+{
+	uint8_t  tail = nvm_tail;
+	uint16_t page;
+
+	if (tail == nvm_head)
+	{
+		// Nothing left to write
+		NVM.INTCTRL = NVM_EELVL_OFF_gc;
+		return;
+	}
+	// Throw away anything left in the page buffer
+	if (NVM.STATUS & NVM_EELOAD_bm)
+	{
+		NVM.CMD = NVM_CMD_ERASE_EEPROM_BUFFER_gc;
+		_PROTECTED_WRITE(NVM.CTRLA, NVM_CMDEX_bm);
+		while (NVM.STATUS & NVM_NVMBUSY_bm);
+	}
+	// Load every queued byte of this page into the page buffer, a store to the mapped EEPROM loads it
+	page = nvm_queue[tail].addr & ~(EEPROM_PAGE_SIZE - 1);
+	NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+	do
+	{
+		*(volatile uint8_t *) (MAPPED_EEPROM_START + nvm_queue[tail].addr) = nvm_queue[tail].value;
+		tail = (tail + 1) & (NVM_QUEUE_SIZE - 1);
+	} while ((tail != nvm_head) && ((nvm_queue[tail].addr & ~(EEPROM_PAGE_SIZE - 1)) == page));
+	nvm_tail = tail;
+	// Erase and write the loaded bytes, the interrupt occurs again when the write is done
+	NVM.ADDR0 = page & 0xFF;
+	NVM.ADDR1 = page >> 8;
+	NVM.ADDR2 = 0;
+	NVM.CMD = NVM_CMD_ERASE_WRITE_EEPROM_PAGE_gc;
+	_PROTECTED_WRITE(NVM.CTRLA, NVM_CMDEX_bm);
+}
+
+#if HAL_OUTPUT_RAMP
+/*
+ * EDMA Channel 0 interrupt (End of V1EN Ramp or Fade)
+ *  Occurs when the last step has been copied, the output is at 100% (or 0%) and the port takes it back.
+ */
+ISR(EDMA_CH0_vect)
+{
+	EDMA.CH0.CTRLB |= EDMA_CH_TRNIF_bm;		// Clear the interrupt flag
+	ramp_stop(_BV(V1EN_bp));
+}
+
+/*
+ * EDMA Channel 2 interrupt (End of V2EN Ramp or Fade)
+ */
+ISR(EDMA_CH2_vect)
+{
+	EDMA.CH2.CTRLB |= EDMA_CH_TRNIF_bm;		// Clear the interrupt flag
+	ramp_stop(_BV(V2EN_bp));
+}
+#endif
+
+/*
+ * RTC Compare interrupt (Stay ON Timers)
+ *  Occurs at the earliest Stay ON deadline. Every running timer whose deadline has passed is expired and
+ *  the compare moves on to the next deadline, if any.
+ */
+ISR(RTC_COMP_vect)
+{
+	timer_schedule();
+}
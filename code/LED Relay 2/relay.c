@@ -0,0 +1,846 @@
+/*
+ * relay.c
+ *
+ *  LED Relay logic. The Power, StayON and Programming State Machines only reach the hardware through the
+ *  HAL (hal.h) so the same code runs on the ATxmega8E5 and in the host build.
+ * Author : Mike Lawrence
+ */
+
+/*
+ * Stay On sequence = ACC2 ON for less than 3 seconds, ACC2 OFF for less than 3 seconds, ACC1 ON.
+ *   Next Power OFF the relay will remain on for programmed timeout (default 30 minute).
+ *   This must be done for each power off cycle you want the Outputs to remain on.
+ *
+ * Independent outputs (CONFIG_MODE_INDEPENDENT) = ACC1 switches VOUT1 and ACC2 switches VOUT2.
+ *   The Stay On sequence is given on the input of the channel: ON for less than 3 seconds, OFF for less
+ *   than 3 seconds, ON. Next time that input turns OFF its output remains on for the channel timeout.
+ */
+
+/*
+ * Programming sequence (Only works within the first 60 seconds of ACC1 turning ON)
+ * Flash sequence = ACC2 ON Pulse OFF each less than 3 seconds. The number of ACC2 pulses represents the 
+ *   number of 10 minute increments to stay on after power off. The range is 1 to 25 increments or 10 - 250 minutes.
+ * Program sequence = ACC2 OFF for 4 to 7 seconds after last flash ACC2 ON, ACC2 ON for 4 to 7 seconds, ACC2 OFF for 4 to 7 seconds, ACC2 ON.
+ *
+ * Example: Program 20 minute stay on after power OFF. 
+ *
+ *   ACC2 ON for 1 sec, ACC2 OFF for 1 sec, ACC2 ON for 1 sec, ACC2 OFF for 5 sec, ACC2 ON for 5 sec, ACC2 OFF for 5 sec, ACC2 ON.
+ *   {    Flash 1     }                    {    Flash 2     }  {   1st Prog OFF  } {   1st Prog ON  } {   2nd Prog OFF  } { Prog Complete }
+ *
+ */
+#include <math.h>
+#include "hal.h"
+#include "config.h"
+#include "relay.h"
+
+/*
+ * Application specific definitions
+ */
+#define FLASH_WAIT_MINUTES				10
+#define MAX_FLASH_COUNT					25
+#define WATCHDOG_WAKE_TIME				1.0
+/*
+ * Inferred definitions
+ */
+#define V12EN_ON()						hal_outputs_set(HAL_OUTPUT_V1 | HAL_OUTPUT_V2)
+#define V12EN_OFF()						hal_outputs_set(0)
+#define V12EN_FADE()					hal_outputs_set(HAL_OUTPUT_FADE)
+#define V12EN_FOLLOW(on)				hal_outputs_set(HAL_OUTPUT_FOLLOW | ((on) ? HAL_OUTPUT_V1 | HAL_OUTPUT_V2 : 0))
+#define MS_FROM_SECONDS(sec)			(uint32_t) round((sec) / 0.001)
+#define MAX_WAIT_MINUTES				(MAX_FLASH_COUNT * FLASH_WAIT_MINUTES)
+#if MAX_WAIT_MINUTES > 255
+#error "MAX_WAIT_MINUTES does not fit in wait_minutes"
+#endif
+#if CONFIG_CHANNELS > HAL_TIMERS
+#error "Every channel needs its own Stay ON timer"
+#endif
+
+/*
+ * Enumerations
+ */
+enum POWER_SM  { SM_POWER_RESET = 0, SM_POWER_DOWN, SM_POWER_OUT_OFF, SM_POWER_OUT_ON, SM_POWER_OUT_STAY_ON, SM_POWER_TIMER, SM_POWER_CHANNELS };
+enum CHANNEL_SM { SM_CH_OFF = 0, SM_CH_ON, SM_CH_STAY_ON, SM_CH_TIMER };
+enum STAYON_SM { SM_STAYON_RESET = 0, SM_STAYON_WAIT_ON, SM_STAYON_WAIT_OFF};
+enum PROG_SM   { SM_PROG_RESET = 0, SM_PROG_FLASH_ON, SM_PROG_FLASH_OFF, SM_PROG_END_ON, SM_PROG_END_OFF, SM_PROG_IND_ON, SM_PROG_IND_OFF };
+
+/*
+ * Global variables (Note best code optimization (code size) requires all defaults to be 0)
+ */
+uint8_t  power_state = SM_POWER_RESET;				// Current power state
+config_t config;									// Configuration, loaded from EEPROM at reset
+uint8_t  flash_count = 0;							// The number of valid program flashes received on ACC2
+uint8_t  channel_state[CONFIG_CHANNELS];			// Channel states with CONFIG_MODE_INDEPENDENT
+
+/*
+ * ACC inputs as seen by main, indexed by ACC_INPUT
+ */
+typedef struct
+{
+	uint8_t  state;								// ON or OFF
+	uint32_t start_ms[2];						// The ms timebase value when the input last turned OFF [OFF] and ON [ON]
+} acc_input_t;
+
+acc_input_t acc[ACC_INPUTS];
+
+/*
+ * Apply an ACC edge to the state seen by main.
+ */
+static void acc_update(uint8_t input, uint8_t level, uint32_t tick_ms)
+{
+	if (level != acc[input].state)
+	{
+		acc[input].state = level;
+		acc[input].start_ms[level] = tick_ms;
+	}
+}
+
+/*
+ * Return the time left in ms until start + window has passed (0 if it already has).
+ */
+static uint32_t time_left(uint32_t start, uint32_t window, uint32_t tick_ms)
+{
+	uint32_t elapsed = tick_ms - start;
+
+	return (elapsed > window) ? 0 : (window - elapsed + 1);
+}
+
+/*
+ * Sequence tables
+ *  The StayON and Programming sequences are both a series of ON and OFF times of one input (ACC2, or the
+ *  channel input for StayON with CONFIG_MODE_INDEPENDENT), so one recognizer runs both from a table of rows.
+ *  Each state times one input level (ON or OFF) from when the input entered it:
+ *
+ *  - Edge rows: the input left the level after more than min and at most max, go to next and do action.
+ *    An edge that matches no row resets the sequence.
+ *  - A timeout row: the input is still at the level after max, go to next and do action.
+ *    Without a timeout row the sequence resets after the longest max of the state.
+ *  - Start rows (reset state only): an ACC edge while the input is at the level and the time the input
+ *    (ACC1 with SEQ_ACC1) has been there is within the window starts the sequence.
+ *
+ *  Rows are sorted by state. Times are indexes into the configured windows so a row is 7 bytes of flash.
+ */
+#define SEQ_EDGE						0x00	// Row matches the input leaving the level
+#define SEQ_TIMEOUT						0x01	// Row matches the input staying at the level for longer than max
+#define SEQ_START						0x02	// Row starts the sequence from the reset state
+#define SEQ_ACC1						0x04	// Start row window is the time ACC1 has been ON
+
+enum SEQ_WINDOW { WIN_0S = 0, WIN_2S, WIN_3S, WIN_4S, WIN_7S, WIN_60S, WIN_NONE };	// WIN_2S - WIN_60S in CONFIG_WINDOW order
+enum SEQ_ACTION { ACT_NONE = 0, ACT_FLASH_CLEAR, ACT_FLASH_COUNT, ACT_PROGRAM, ACT_STAY_ON };
+enum SEQ_MACHINE { SEQ_STAYON = 0, SEQ_PROG, SEQ_STAYON2, SEQ_MACHINES };	// SEQ_STAYON2 only with CONFIG_MODE_INDEPENDENT
+
+typedef struct
+{
+	uint8_t  state;								// State the row belongs to
+	uint8_t  level;								// Input level timed in this state
+	uint8_t  min;								// Window index, time must be longer than this
+	uint8_t  max;								// Window index, time must not be longer than this
+	uint8_t  next;								// Next state when the row matches
+	uint8_t  action;							// Action when the row matches
+	uint8_t  flags;								// SEQ_EDGE, SEQ_TIMEOUT or SEQ_START (+SEQ_ACC1)
+} seq_row_t;
+
+typedef struct
+{
+	const seq_row_t *rows;						// Sequence table in flash
+	uint8_t  count;								// Number of rows
+	uint8_t  input;								// ACC input the sequence is given on
+	uint8_t  state;								// Current state
+	uint32_t start_ms;							// The ms timebase value when the timed input level started
+	uint32_t window_ms;							// Time in the state before it times out, HAL_NO_DEADLINE if never
+} seq_machine_t;
+
+static const seq_row_t stayon_rows[] HAL_FLASH =
+{
+	// state				level	min		max		next					action			flags
+	{ SM_STAYON_RESET,		ON,		WIN_0S,	WIN_NONE, SM_STAYON_WAIT_ON,	ACT_NONE,		SEQ_START },
+	{ SM_STAYON_WAIT_ON,	ON,		WIN_0S,	WIN_3S,	SM_STAYON_WAIT_OFF,		ACT_NONE,		SEQ_EDGE },
+	{ SM_STAYON_WAIT_OFF,	OFF,	WIN_0S,	WIN_3S,	SM_STAYON_RESET,		ACT_STAY_ON,	SEQ_EDGE },
+};
+
+static const seq_row_t prog_rows[] HAL_FLASH =
+{
+	// state				level	min		max		next					action			flags
+	{ SM_PROG_RESET,		ON,		WIN_0S,	WIN_60S, SM_PROG_FLASH_ON,		ACT_FLASH_CLEAR, SEQ_START | SEQ_ACC1 },
+	{ SM_PROG_FLASH_ON,		ON,		WIN_0S,	WIN_3S,	SM_PROG_FLASH_OFF,		ACT_FLASH_COUNT, SEQ_EDGE },
+	{ SM_PROG_FLASH_OFF,	OFF,	WIN_0S,	WIN_3S,	SM_PROG_FLASH_ON,		ACT_NONE,		SEQ_EDGE },
+	{ SM_PROG_FLASH_OFF,	OFF,	WIN_4S,	WIN_7S,	SM_PROG_END_ON,			ACT_NONE,		SEQ_EDGE },
+	{ SM_PROG_END_ON,		ON,		WIN_4S,	WIN_7S,	SM_PROG_END_OFF,		ACT_NONE,		SEQ_EDGE },
+	{ SM_PROG_END_OFF,		OFF,	WIN_4S,	WIN_7S,	SM_PROG_IND_ON,			ACT_PROGRAM,	SEQ_EDGE },
+	{ SM_PROG_IND_ON,		ON,		WIN_0S,	WIN_2S,	SM_PROG_IND_OFF,		ACT_NONE,		SEQ_TIMEOUT },
+	{ SM_PROG_IND_OFF,		ON,		WIN_0S,	WIN_3S,	SM_PROG_RESET,			ACT_NONE,		SEQ_TIMEOUT },
+};
+
+seq_machine_t seq[SEQ_MACHINES] =
+{
+	{ stayon_rows, sizeof(stayon_rows) / sizeof(seq_row_t), ACC2_INPUT, SM_STAYON_RESET, 0, HAL_NO_DEADLINE },
+	{ prog_rows, sizeof(prog_rows) / sizeof(seq_row_t), ACC2_INPUT, SM_PROG_RESET, 0, HAL_NO_DEADLINE },
+	{ stayon_rows, sizeof(stayon_rows) / sizeof(seq_row_t), ACC2_INPUT, SM_STAYON_RESET, 0, HAL_NO_DEADLINE },
+};
+uint8_t  seq_count = 0;								// Machines running, set at reset from the channel mode
+
+#define SEQ_ROW(m, row, field)			HAL_FLASH_BYTE(&(m)->rows[row].field)
+
+/*
+ * Return a window in ms, HAL_NO_DEADLINE for WIN_NONE.
+ */
+static uint32_t seq_window(uint8_t index)
+{
+	if (index == WIN_0S)
+	{
+		return 0;
+	}
+	if (index == WIN_NONE)
+	{
+		return HAL_NO_DEADLINE;
+	}
+	return config.windows_ms[index - WIN_2S];
+}
+
+/*
+ * Return TRUE when time_ms is longer than the row min and not longer than the row max.
+ */
+static uint8_t seq_in_window(seq_machine_t *m, uint8_t row, uint32_t time_ms)
+{
+	uint8_t min = SEQ_ROW(m, row, min);
+
+	return ((min == WIN_0S) || (time_ms > seq_window(min))) && (time_ms <= seq_window(SEQ_ROW(m, row, max)));
+}
+
+/*
+ * Return the first row of a state, the rows are sorted by state.
+ */
+static uint8_t seq_first(seq_machine_t *m, uint8_t state)
+{
+	uint8_t row = 0;
+
+	while ((row < m->count) && (SEQ_ROW(m, row, state) != state))
+	{
+		row++;
+	}
+	return row;
+}
+
+/*
+ * Enter a state and work out when it times out.
+ */
+static void seq_enter(seq_machine_t *m, uint8_t state)
+{
+	uint8_t row = seq_first(m, state);
+	uint32_t window;
+
+	m->state = state;
+	m->window_ms = HAL_NO_DEADLINE;
+	if (state == 0)
+	{
+		// Reset state, only an ACC edge starts the sequence
+		return;
+	}
+	m->start_ms = acc[m->input].start_ms[SEQ_ROW(m, row, level)];
+	m->window_ms = 0;
+	for (; (row < m->count) && (SEQ_ROW(m, row, state) == state); row++)
+	{
+		window = seq_window(SEQ_ROW(m, row, max));
+		if (window > m->window_ms)
+		{
+			m->window_ms = window;
+		}
+	}
+}
+
+/*
+ * Follow a row, do its action and enter its next state.
+ */
+static void seq_follow(seq_machine_t *m, uint8_t row)
+{
+	uint8_t i;
+
+	switch (SEQ_ROW(m, row, action))
+	{
+	case ACT_FLASH_CLEAR:
+		flash_count = 0;						// Reset flash_count before using it
+		break;
+	case ACT_FLASH_COUNT:
+		if (flash_count < MAX_FLASH_COUNT)
+		{
+			++flash_count;						// Increment flash count, extra flashes are ignored
+		}
+		break;
+	case ACT_PROGRAM:
+		// Each flash is 10 minutes
+		flash_count = flash_count * FLASH_WAIT_MINUTES;
+		// Update wait time in RAM, programming sets every channel
+		for (i = 0; i < CONFIG_CHANNELS; i++)
+		{
+			config.wait_minutes[i] = flash_count;
+		}
+		//  Queue the new configuration for EEPROM, the indication doesn't wait for the write
+		config_save(&config);
+		break;
+	case ACT_STAY_ON:
+		if (config.channel_mode == CONFIG_MODE_INDEPENDENT)
+		{
+			// Only the channel of the input, a Stay ON timer still running from before is not needed
+			hal_timer_stop(m->input);
+			channel_state[m->input] = SM_CH_STAY_ON;
+		}
+		else
+		{
+			power_state = SM_POWER_OUT_STAY_ON;	// Force the Power State Machine to Output Stay ON state
+		}
+		break;
+	}
+	seq_enter(m, SEQ_ROW(m, row, next));
+}
+
+/*
+ * Advance one sequence at tick_ms, at most one row is followed per call.
+ */
+static void seq_update(seq_machine_t *m, uint32_t tick_ms, uint8_t edge)
+{
+	uint8_t  row = seq_first(m, m->state);
+	uint8_t  flags;
+	uint32_t start;
+
+	if (m->state == 0)
+	{
+		// Reset state, look for a start row on an ACC edge
+		if (!edge)
+		{
+			return;
+		}
+		for (; (row < m->count) && (SEQ_ROW(m, row, state) == 0); row++)
+		{
+			flags = SEQ_ROW(m, row, flags);
+			if ((flags & SEQ_START) && (acc[m->input].state == SEQ_ROW(m, row, level)))
+			{
+				start = (flags & SEQ_ACC1) ? acc[ACC1_INPUT].start_ms[ON] : acc[m->input].start_ms[acc[m->input].state];
+				if (seq_in_window(m, row, tick_ms - start))
+				{
+					seq_follow(m, row);
+					return;
+				}
+			}
+		}
+		return;
+	}
+	if (acc[m->input].state != SEQ_ROW(m, row, level))
+	{
+		// The input left the timed level, find the edge row for how long it was there
+		for (; (row < m->count) && (SEQ_ROW(m, row, state) == m->state); row++)
+		{
+			if ((SEQ_ROW(m, row, flags) == SEQ_EDGE) && seq_in_window(m, row, tick_ms - m->start_ms))
+			{
+				seq_follow(m, row);
+				return;
+			}
+		}
+		seq_enter(m, 0);						// No match, reset the sequence
+	}
+	else if ((tick_ms - m->start_ms) > m->window_ms)
+	{
+		// The input stayed at the level for too long, follow the timeout row if there is one
+		for (; (row < m->count) && (SEQ_ROW(m, row, state) == m->state); row++)
+		{
+			if (SEQ_ROW(m, row, flags) == SEQ_TIMEOUT)
+			{
+				seq_follow(m, row);
+				return;
+			}
+		}
+		seq_enter(m, 0);						// Reset the sequence
+	}
+}
+
+/*
+ * Return the time in ms until the start window of a sequence in its reset state closes, HAL_NO_DEADLINE
+ *  when it is not open. An ACC edge within the window starts the sequence.
+ */
+static uint32_t seq_start_left(seq_machine_t *m, uint32_t tick_ms)
+{
+	uint8_t  row;
+	uint8_t  flags;
+	uint32_t window;
+	uint32_t wait_ms = HAL_NO_DEADLINE;
+	uint32_t left;
+
+	if (m->state != 0)
+	{
+		return HAL_NO_DEADLINE;
+	}
+	for (row = seq_first(m, 0); (row < m->count) && (SEQ_ROW(m, row, state) == 0); row++)
+	{
+		flags = SEQ_ROW(m, row, flags);
+		window = seq_window(SEQ_ROW(m, row, max));
+		if (!(flags & SEQ_START) || (window == HAL_NO_DEADLINE) || ((flags & SEQ_ACC1) && !acc[ACC1_INPUT].state))
+		{
+			continue;
+		}
+		left = time_left((flags & SEQ_ACC1) ? acc[ACC1_INPUT].start_ms[ON] : acc[m->input].start_ms[SEQ_ROW(m, row, level)],
+						 window, tick_ms);
+		if (left && (left < wait_ms))
+		{
+			wait_ms = left;
+		}
+	}
+	return wait_ms;
+}
+
+/*
+ * Return the time in ms until the StayON, Programming or Power State Machines next need to be evaluated
+ *  when no ACC edge occurs before then. HAL_NO_DEADLINE when only an ACC edge can change their state.
+ */
+static uint32_t next_deadline(uint32_t tick_ms)
+{
+	uint32_t wait_ms = HAL_NO_DEADLINE;
+	uint32_t left;
+	uint8_t  i;
+
+	// StayON and Programming windows
+	for (i = 0; i < seq_count; i++)
+	{
+		if (seq[i].window_ms != HAL_NO_DEADLINE)
+		{
+			left = time_left(seq[i].start_ms, seq[i].window_ms, tick_ms);
+			if (left < wait_ms)
+			{
+				wait_ms = left;
+			}
+		}
+	}
+	// Start windows, the time an input has been at a level is only measured while the timebase counts
+	for (i = 0; i < seq_count; i++)
+	{
+		left = seq_start_left(&seq[i], tick_ms);
+		if (left < wait_ms)
+		{
+			wait_ms = left;
+		}
+	}
+	// Stay ON is cancelled by ACC2 OFF for longer than 0.5 seconds
+	if ((power_state == SM_POWER_OUT_STAY_ON) && !acc[ACC2_INPUT].state)
+	{
+		left = time_left(acc[ACC2_INPUT].start_ms[OFF], MS_FROM_SECONDS(0.5), tick_ms);
+		if (left < wait_ms)
+		{
+			wait_ms = left;
+		}
+	}
+	return wait_ms;
+}
+
+/*
+ * Return TRUE while a Stay ON timer is running.
+ */
+static uint8_t timer_running(void)
+{
+	uint8_t ch;
+
+	if (power_state == SM_POWER_TIMER)
+	{
+		return TRUE;
+	}
+	for (ch = 0; (power_state == SM_POWER_CHANNELS) && (ch < CONFIG_CHANNELS); ch++)
+	{
+		if (channel_state[ch] == SM_CH_TIMER)
+		{
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Sleep Manager
+ *  Return the deepest sleep mode the State Machines can wait in until the next deadline (wait_ms). A
+ *  deadline is timed with the ms timebase, which only counts in Idle Mode. A running Stay ON timer needs
+ *  the RTC, which keeps running in Power-Save Mode. Otherwise only an ACC edge can change anything and
+ *  Power-Down Mode will do. hal_sleep() still stays in Idle Mode while the hardware is busy.
+ */
+static uint8_t sleep_select(uint32_t wait_ms)
+{
+	if (wait_ms != HAL_NO_DEADLINE)
+	{
+		return HAL_SLEEP_IDLE;
+	}
+	if (timer_running())
+	{
+		return HAL_SLEEP_PSAVE;
+	}
+	return HAL_SLEEP_PDOWN;
+}
+
+/*
+ * Return TRUE when no StayON or Programming sequence is in progress.
+ */
+static uint8_t sequence_idle(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < seq_count; i++)
+	{
+		if (seq[i].state != 0)
+		{
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * StayON and Programming State Machines
+ *  Evaluated on every ACC edge at the time of the edge (edge is TRUE) and once per main loop for timeouts.
+ *  Both sequences only start on an edge so a long ACC2 ON never has to be polled.
+ */
+static void sequence_update(uint32_t tick_ms, uint8_t edge)
+{
+	uint8_t i;
+
+	for (i = 0; i < seq_count; i++)
+	{
+		if (!acc[ACC1_INPUT].state && ((config.channel_mode != CONFIG_MODE_INDEPENDENT) || (i == SEQ_PROG)))
+		{
+			// The StayON State Machine and Programming State Machines do not run when ACC1 is OFF
+			//  Each channel has its own StayON with independent outputs, only Programming needs ACC1
+			seq_enter(&seq[i], 0);
+		}
+		else
+		{
+			seq_update(&seq[i], tick_ms, edge);
+		}
+	}
+}
+
+/*
+ * Channel State Machine (CONFIG_MODE_INDEPENDENT)
+ *  Input ch switches output ch, after the StayON sequence the output stays ON for the wait time of the
+ *  channel once the input turns OFF. Returns the output bit while the channel is ON, HAL_OUTPUT_FADE when
+ *  its Stay ON time is over.
+ */
+static uint8_t channel_update(uint8_t ch)
+{
+	uint8_t on = acc[ch].state;
+
+	switch (channel_state[ch])
+	{
+	case SM_CH_ON:								// Output is ON while the input is ON
+		if (!on)
+		{
+			channel_state[ch] = SM_CH_OFF;
+		}
+		break;
+	case SM_CH_STAY_ON:							// Output is ON, the input turning OFF starts the Stay ON timer
+		if (!on)
+		{
+			channel_state[ch] = SM_CH_TIMER;
+			hal_timer_start(ch, config.wait_minutes[ch]);
+		}
+		break;
+	case SM_CH_TIMER:							// Input is OFF, Output is ON until the timeout
+		if (on)
+		{
+			hal_timer_stop(ch);					// The input is back ON, the Stay ON timer is no longer needed
+			channel_state[ch] = SM_CH_ON;
+		}
+		else if (hal_timer_expired(ch))
+		{
+			hal_timer_stop(ch);
+			channel_state[ch] = SM_CH_OFF;
+			return HAL_OUTPUT_FADE;				// The output fades OFF
+		}
+		break;
+	default:									// Output is OFF until the input is ON
+		if (on)
+		{
+			channel_state[ch] = SM_CH_ON;
+		}
+		break;
+	}
+	return (channel_state[ch] == SM_CH_OFF) ? 0 : (HAL_OUTPUT_V1 << ch);
+}
+
+/*
+ * Reset the State Machines, the hardware is initialized by the first relay_step().
+ */
+void relay_init(void)
+{
+	power_state = SM_POWER_RESET;
+	seq_enter(&seq[SEQ_STAYON], SM_STAYON_RESET);
+	seq_enter(&seq[SEQ_PROG], SM_PROG_RESET);
+	seq_enter(&seq[SEQ_STAYON2], SM_STAYON_RESET);
+	// Disable the Watchdog timer on start
+	hal_wdt_disable();
+}
+
+/*
+ * One pass of the main loop.
+ *  Consumes the pending ACC edges, runs the State Machines and sleeps until something can change.
+ */
+void relay_step(void)
+{
+	acc_event_t event;								// Next ACC edge
+	uint32_t tick_ms;								// Current time in ms
+	uint32_t wait_ms;								// Time until the next deadline in ms
+	uint8_t  last_power_state;						// Power state at the start of the loop
+	uint8_t  outputs;								// Outputs of the channels
+	uint8_t  mode;									// Sleep mode until the next deadline
+	uint8_t  ch;
+
+	// Each loop of main reset the Watchdog timer
+	hal_wdt_reset();
+	// Consume every ACC edge in the order it occurred
+	while (hal_event_get(&event))
+	{
+		acc_update(event.input, event.level, event.tick_ms);
+		sequence_update(event.tick_ms, TRUE);
+	}
+	// Get the current time
+	tick_ms = hal_clock_ms();
+	// StayON and Programming timeouts, before the State Machines so they act on them in this pass
+	sequence_update(tick_ms, FALSE);
+	last_power_state = power_state;
+
+	// Power State Machine
+	//   Manages initialization and the Power Switches
+	switch (power_state)
+	{
+	case SM_POWER_DOWN:							// Board is Powered Down, Output is OFF, waiting for ACC1 turn ON
+		V12EN_FOLLOW(OFF);						// The power switches are OFF until ACC1 and ACC2 are ON
+		// See if ACC1 has switched ON
+		if (acc[ACC1_INPUT].state)
+		{
+			// ACC1 is now ON, what state we goto is dependent on ACC2
+			if (acc[ACC2_INPUT].state)
+			{
+				// ACC2 is ON
+				power_state = SM_POWER_OUT_ON;	// Switch to Output ON state
+			}
+			else
+			{
+				// ACC2 is OFF
+				power_state = SM_POWER_OUT_OFF;	// Switch to Output OFF state
+			}
+		}
+		break;
+	case SM_POWER_OUT_OFF:						// Board is ON, Output is OFF (ACC1 is ON, ACC2 is OFF)
+		V12EN_FOLLOW(OFF);						// The power switches are OFF until ACC2 is ON
+		// See if ACC1 has switched OFF
+		if (!acc[ACC1_INPUT].state)
+		{
+			// ACC1 is now OFF
+			power_state = SM_POWER_DOWN;		// Switch to Power Down State
+		}
+		else
+		{
+			// ACC1 is still ON, See if ACC2 has switched ON
+			if (acc[ACC2_INPUT].state)
+			{
+				// ACC2 is now ON
+				power_state = SM_POWER_OUT_ON;	// Switch to Output On State
+			}
+		}
+		break;
+	case SM_POWER_OUT_ON:						// Board is ON, Output is ON (ACC1 is ON, ACC2 is ON)
+		if (seq[SEQ_PROG].state == SM_PROG_IND_OFF)
+		{
+			// The power switches are always OFF when Programming State is in Programming Success Output OFF state
+			//  Handy indicator of programming success
+			V12EN_OFF();						// The power switches are OFF
+		}
+		else
+		{
+			// Normal operation of Power Switches
+			V12EN_FOLLOW(ON);					// The power switches are ON until ACC1 or ACC2 is OFF
+		}
+		// See if ACC1 has switched OFF
+		if (!acc[ACC1_INPUT].state)
+		{
+			// ACC1 is now OFF
+			power_state = SM_POWER_DOWN;		// We need to power down
+		}
+		else
+		{
+			// ACC1 is still ON, See if ACC2 has switched OFF
+			if (!acc[ACC2_INPUT].state)
+			{
+				// ACC2 is now OFF
+				power_state = SM_POWER_OUT_OFF;	// Switch to Output Off State
+			}
+		}
+		break;
+	case SM_POWER_OUT_STAY_ON:					// Board is ON, Output is ON (ACC1 is ON, ACC2 is ON)
+		if (seq[SEQ_PROG].state == SM_PROG_IND_OFF)
+		{
+			// The power switches are always OFF when Programming State is in Programming Success Output OFF state
+			//  Handy indicator of programming success
+			V12EN_OFF();						// The power switches are OFF
+		}
+		else
+		{
+			// Normal operation of Power Switches
+			V12EN_ON();							// The power switches are ON				
+		}
+		// See if ACC1 has switched OFF
+		if (!acc[ACC1_INPUT].state)
+		{
+			// ACC1 is now OFF
+			power_state = SM_POWER_TIMER;		// We need to enter Timer State
+			hal_timer_start(0, config.wait_minutes[0]);	// Start the Stay ON timer
+		}
+		else
+		{
+			// ACC1 is still ON, See if ACC2 has switched OFF
+			if (!acc[ACC2_INPUT].state)
+			{
+				// ACC2 is now OFF
+				//  Make sure ACC2 OFF time is longer than 0.5 seconds before switching states
+				//  This will allow ACC2 to turn off up to 0.5 seconds before ACC1 and
+				//   still be recognized as Power Stay ON
+				if ((tick_ms - acc[ACC2_INPUT].start_ms[OFF]) > MS_FROM_SECONDS(0.5))
+				{
+					power_state = SM_POWER_OUT_OFF;	// Switch to Output Off State
+				}
+			}
+		}
+		break;
+	case SM_POWER_TIMER:						// ACC1 is OFF, Output is ON and waiting for timeout to occur
+		V12EN_ON();								// The power switches are ON
+		// See if ACC1 has switched ON
+		if (acc[ACC1_INPUT].state)
+		{
+			// ACC1 is now ON, the Stay ON timer is no longer needed
+			hal_timer_stop(0);
+			// What state we goto is dependent on ACC2
+			if (acc[ACC2_INPUT].state)
+			{
+				// ACC2 is ON
+				power_state = SM_POWER_OUT_ON;	// Switch to Output ON state
+			}
+			else
+			{
+				// ACC2 is OFF
+				power_state = SM_POWER_OUT_OFF;	// Switch to Output OFF state
+			}
+		}
+		else
+		{
+			// ACC1 is still OFF, see if timeout has occurred
+			if (hal_timer_expired(0))
+			{
+				// Timeout has occurred
+				hal_timer_stop(0);				// Stop the Stay ON timer
+				V12EN_FADE();					// The power switches fade OFF, Power Down waits for the fade
+				power_state = SM_POWER_DOWN;	// Switch to Power Down State
+			}
+			// no timeout so go back to sleep (RTC compare or ACC1 turning ON will wake us up)
+		}
+		break;
+	case SM_POWER_CHANNELS:						// Independent outputs, each channel follows its own input
+		outputs = 0;
+		for (ch = 0; ch < CONFIG_CHANNELS; ch++)
+		{
+			outputs |= channel_update(ch);
+		}
+		if (seq[SEQ_PROG].state == SM_PROG_IND_OFF)
+		{
+			// Programming success indicator, the power switches are OFF
+			outputs &= HAL_OUTPUT_FADE;
+		}
+		hal_outputs_set(outputs);
+		break;
+	default:
+		// Anything else is considered to SM_POWER_RESET
+		hal_init();								// Initialize the hardware and enable interrupts
+		for (ch = 0; ch < ACC_INPUTS; ch++)
+		{
+			acc[ch].state = hal_input_get(ch);	// Start with the same ACC states as the HAL
+		}
+		if (acc[ACC1_INPUT].state)
+		{
+			// ACC1 is currently on
+			if (acc[ACC2_INPUT].state)
+			{
+				// ACC1 and ACC2 are on
+				power_state = SM_POWER_OUT_ON;	// Switch to Power Active State
+			}
+			else
+			{
+				// ACC1 is ON, ACC2 is OFF
+				power_state = SM_POWER_OUT_OFF;	// Switch to Power Active State
+			}
+		}
+		else
+		{
+			// ACC1 is currently off
+			power_state = SM_POWER_DOWN;		// Switch to Power Down State
+		}
+		// Read the configuration from EEPROM
+		config_load(&config);
+		for (ch = 0; ch < CONFIG_CHANNELS; ch++)
+		{
+			if ((config.wait_minutes[ch] == 0) || (config.wait_minutes[ch] > MAX_WAIT_MINUTES))
+			{
+				// Out of range, a zero compare would never expire so use the default
+				config.wait_minutes[ch] = CONFIG_WAIT_MINUTES;
+			}
+		}
+		if (config.channel_mode == CONFIG_MODE_INDEPENDENT)
+		{
+			// Each output follows its own input with its own StayON sequence
+			power_state = SM_POWER_CHANNELS;
+			seq[SEQ_STAYON].input = ACC1_INPUT;
+			seq_count = SEQ_MACHINES;
+			for (ch = 0; ch < CONFIG_CHANNELS; ch++)
+			{
+				channel_state[ch] = acc[ch].state ? SM_CH_ON : SM_CH_OFF;
+			}
+		}
+		else
+		{
+			seq_count = SEQ_STAYON2;
+		}
+		if (config.debounce_ms == 0)
+		{
+			config.debounce_ms = CONFIG_DEBOUNCE_MS;
+		}
+		hal_debounce_set(config.debounce_ms);
+		if (config.ramp_ms == 0)
+		{
+			config.ramp_ms = CONFIG_RAMP_MS;
+		}
+		hal_ramp_set(config.ramp_ms);
+		if (config.fade_ms == 0)
+		{
+			config.fade_ms = CONFIG_FADE_MS;
+		}
+		hal_fade_set(config.fade_ms);
+		// Enable the Watchdog timer
+		hal_wdt_enable();
+		return;									//  restart the main forever loop
+	}
+	// Nothing changes until the next ACC edge or deadline, so wait for it as deep as it allows
+	if (power_state == last_power_state)
+	{
+		wait_ms = next_deadline(tick_ms);
+		mode = sleep_select(wait_ms);
+		if (mode == HAL_SLEEP_IDLE)
+		{
+			// Parked with the outputs following the inputs, the slow clock is plenty until something happens
+			hal_clock_slow(sequence_idle() && ((power_state == SM_POWER_OUT_ON) || (power_state == SM_POWER_OUT_OFF)
+												|| (power_state == SM_POWER_CHANNELS)));
+			if (wait_ms > MS_FROM_SECONDS(WATCHDOG_WAKE_TIME))
+			{
+				wait_ms = MS_FROM_SECONDS(WATCHDOG_WAKE_TIME);	// Wake up in time to reset the Watchdog timer
+			}
+			hal_sleep(HAL_SLEEP_IDLE, wait_ms);
+		}
+		else
+		{
+			// ACC1 and ACC2 ON turns both outputs ON in every state that sleeps this deep, the HAL can do it
+			//  as soon as the edge wakes it up
+			hal_outputs_wake(HAL_OUTPUT_V1 | HAL_OUTPUT_V2);
+			hal_wdt_disable();						// Disable the watchdog timer before going to sleep
+			hal_sleep(mode, HAL_NO_DEADLINE);		// Only an ACC edge or the RTC wakes us up
+			hal_wdt_enable();						// Enable the Watchdog timer
+		}
+	}
+}
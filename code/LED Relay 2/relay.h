@@ -0,0 +1,13 @@
+/*
+ * relay.h
+ *
+ *  LED Relay logic, hardware independent. See hal.h for the hardware it needs.
+ */
+
+#ifndef RELAY_H_
+#define RELAY_H_
+
+void relay_init(void);
+void relay_step(void);
+
+#endif /* RELAY_H_ */
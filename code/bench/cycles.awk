@@ -0,0 +1,415 @@
+# cycles.awk
+#
+#  Worst case cycle count of the firmware hot paths from the avr-objdump -d listing.
+#
+#  First file is the target list, "<name> <symbol>" per line, second file is the listing. For every
+#  target the longest path through the function is found using the AVRxm (XMega) instruction timing,
+#  with each call adding the worst case of the called function. ISRs also get the 5 cycle interrupt
+#  response and the 3 cycle JMP in the vector table.
+#
+#  A latency target, "<name> <symbol> <address>[@<function>]", is the longest path from the function entry
+#  to the first store to the data address instead, through any function it calls. With @<function> only a
+#  store inside that function counts, so an earlier store to the same register (e.g. stopping a timer
+#  before starting it again) doesn't end the path. Paths that never get there don't count, "unreached"
+#  means none does. An optional fourth field is a number of cycles the hardware takes after the store
+#  before the output changes, it is added and reported as "hw".
+#
+#  Stores are STS and ST/STD through X, Y or Z. The address of an indirect store is known when the pointer
+#  was loaded with LDI in the same function and kept (with post increment and pre decrement) on every
+#  path to the store, anything else writing the pointer or a call forgets it.
+#
+#  Backward branches (loops) are counted once and reported as "loop", such a count is one pass through
+#  each loop and not a worst case. Indirect calls can't be followed and are reported as "icall". Static
+#  functions that were inlined have no symbol and are reported as "inlined".
+#
+#  Output is "<name> <cycles> <us at f_cpu> [notes]".
+
+function hex(s,    i, c, v)
+{
+	v = 0
+	s = tolower(s)
+	sub(/^0x/, "", s)
+	for (i = 1; i <= length(s); i++)
+	{
+		c = index("0123456789abcdef", substr(s, i, 1))
+		if (c == 0)
+			break
+		v = v * 16 + c - 1
+	}
+	return v
+}
+
+# Cycles for the not taken / no skip case
+function base_cycles(m)
+{
+	if (m ~ /^(adiw|sbiw|mul|muls|mulsu|fmul|fmuls|fmulsu|pop|rjmp|ijmp|eijmp|rcall|icall|eicall|ld|ldd)$/)
+		return (m == "ldd") ? 3 : 2
+	if (m ~ /^(std|sts|xch|las|lac|lat)$/)
+		return 2
+	if (m ~ /^(lds|lpm|elpm|jmp|call)$/)
+		return 3
+	if (m ~ /^(ret|reti)$/)
+		return 4
+	return 1
+}
+
+FNR == NR {
+	if (NF >= 2)
+	{
+		ntargets++
+		tname[ntargets] = $1
+		tsym[ntargets] = $2
+		tstop[ntargets] = -1
+		tfunc[ntargets] = ""
+		if (NF >= 3)
+		{
+			tstop[ntargets] = hex($3)
+			if (match($3, /@.+$/))
+				tfunc[ntargets] = substr($3, RSTART + 1)
+		}
+		thw[ntargets] = (NF >= 4) ? $4 + 0 : 0
+	}
+	next
+}
+
+# Function header, "000001a2 <__vector_12>:"
+/^[0-9a-f]+ <[^>]+>:$/ {
+	func_name = $2
+	gsub(/[<>:]/, "", func_name)
+	func_start[func_name] = hex($1)
+	nfuncs++
+	funcs[nfuncs] = func_name
+	next
+}
+
+# Instruction, " 1a2:\t1f 92       \tpush\tr1"
+/^ *[0-9a-f]+:\t/ {
+	n = split($0, f, "\t")
+	if (n < 3 || func_name == "")
+		next
+	a = f[1]
+	gsub(/[ :]/, "", a)
+	a = hex(a)
+	bytes = f[2]
+	gsub(/ +$/, "", bytes)
+	ninsn++
+	iaddr[ninsn] = a
+	isize[ninsn] = int((length(bytes) + 1) / 3)
+	imn[ninsn] = f[3]
+	ifunc[ninsn] = func_name
+	itarget[ninsn] = -1
+	if (match($0, /; 0x[0-9a-f]+/))
+		itarget[ninsn] = hex(substr($0, RSTART + 2, RLENGTH - 2))
+	if (imn[ninsn] ~ /^(call|rcall|jmp|rjmp)$/ && match($0, /<[^>+]+>/))
+		icallee[ninsn] = substr($0, RSTART + 1, RLENGTH - 2)
+	else
+		icallee[ninsn] = ""
+	iops[ninsn] = (n >= 4) ? f[4] : ""
+	index_of[a] = ninsn
+	next
+}
+
+# Register number of "r<n>", -1 for anything else
+function reg(s)
+{
+	return (s ~ /^r[0-9]+$/) ? substr(s, 2) + 0 : -1
+}
+
+# Remember the pointer registers r26-r31 (X, Y, Z) at instruction j reached from here, differing values
+#  are unknown
+function ptr_join(j,    r)
+{
+	for (r = 26; r <= 31; r++)
+	{
+		if (!((j, r) in join_val))
+			join_val[j, r] = ptr[r]
+		else if (join_val[j, r] != ptr[r])
+			join_val[j, r] = -1
+	}
+}
+
+# Update ptr[] for a pointer operand, "-Z" before the access and "Z+" after it
+function ptr_step(op, when,    lo, v)
+{
+	if (op !~ /^-?[XYZ]\+?$/)
+		return
+	lo = (op ~ /X/) ? 26 : (op ~ /Y/) ? 28 : 30
+	if (ptr[lo] < 0 || ptr[lo + 1] < 0)
+		return
+	v = ptr[lo] + 256 * ptr[lo + 1]
+	if (when == "pre" && op ~ /^-/)
+		v--
+	else if (when == "post" && op ~ /\+$/)
+		v++
+	else
+		return
+	v = (v + 65536) % 65536
+	ptr[lo] = v % 256
+	ptr[lo + 1] = int(v / 256)
+}
+
+# Data address of an STS, ST or STD at instruction i with the pointers in ptr[], -1 when unknown
+function store_addr(i, op,    m, lo, d)
+{
+	m = imn[i]
+	if (m == "sts")
+		return hex(op)
+	if (m != "st" && m != "std")
+		return -1
+	lo = (op ~ /X/) ? 26 : (op ~ /Y/) ? 28 : 30
+	if (ptr[lo] < 0 || ptr[lo + 1] < 0)
+		return -1
+	d = (match(op, /\+[0-9]+$/)) ? substr(op, RSTART + 1) + 0 : 0
+	return ptr[lo] + 256 * ptr[lo + 1] + d
+}
+
+# Store address of every instruction, following the pointer registers down each function in listing
+#  order. A branch target takes the pointers of every forward jump to it and of the instruction before
+#  it, the target of a backward jump forgets them.
+function find_stores(    i, j, r, m, ops, op, d, fall)
+{
+	for (i = 1; i <= ninsn; i++)
+		if (itarget[i] in index_of && ifunc[index_of[itarget[i]]] == ifunc[i] && iaddr[index_of[itarget[i]]] <= iaddr[i])
+			back_target[index_of[itarget[i]]] = 1
+	fall = 0
+	for (i = 1; i <= ninsn; i++)
+	{
+		if (i == 1 || ifunc[i] != ifunc[i - 1])
+			fall = 0
+		if (fall)
+			ptr_join(i)
+		for (r = 26; r <= 31; r++)
+			ptr[r] = ((i, r) in join_val && !(i in back_target)) ? join_val[i, r] : -1
+		m = imn[i]
+		split(iops[i], ops, /, */)
+		op = (m ~ /^(st|std|sts)$/) ? ops[1] : ops[2]
+		ptr_step(op, "pre")
+		istore[i] = store_addr(i, op)
+		ptr_step(op, "post")
+		d = reg(ops[1])
+		if (m == "ldi" && d >= 26)
+			ptr[d] = hex(ops[2])
+		else if (d >= 26 && m !~ /^(cp|cpc|cpi|cpse|tst|sbrc|sbrs|push|bst)$/)
+		{
+			ptr[d] = -1
+			if (m ~ /^(movw|adiw|sbiw)$/ && d < 31)
+				ptr[d + 1] = -1
+		}
+		if (m ~ /^(call|rcall|icall|eicall)$/)
+			ptr[26] = ptr[27] = ptr[30] = ptr[31] = -1
+		if ((m ~ /^(br|jmp|rjmp)/) && itarget[i] in index_of)
+		{
+			j = index_of[itarget[i]]
+			if (ifunc[j] == ifunc[i] && iaddr[j] > iaddr[i])
+				ptr_join(j)
+		}
+		if (m ~ /^(cpse|sbrc|sbrs|sbic|sbis)$/ && i + 2 <= ninsn && ifunc[i + 2] == ifunc[i])
+			ptr_join(i + 2)
+		fall = (m !~ /^(jmp|rjmp|ijmp|eijmp|ret|reti)$/)
+	}
+}
+
+# Longest path cost from instruction i, all successors past i are already known
+function path_from(i,    m, c, best, t, next_i, skip_i, alt)
+{
+	m = imn[i]
+	c = base_cycles(m)
+	next_i = (i < ninsn && ifunc[i + 1] == ifunc[i]) ? i + 1 : 0
+	if (m == "ret" || m == "reti")
+		return c
+	if (m == "icall" || m == "eicall" || m == "ijmp" || m == "eijmp")
+	{
+		note[ifunc[i]] = note[ifunc[i]] " icall"
+		return c + (next_i && m ~ /call/ ? cost[next_i] : 0)
+	}
+	if (m == "call" || m == "rcall")
+	{
+		return c + callee_cost(icallee[i], ifunc[i]) + (next_i ? cost[next_i] : 0)
+	}
+	if (m == "jmp" || m == "rjmp")
+	{
+		if (icallee[i] != "" && icallee[i] != ifunc[i])
+			return c + callee_cost(icallee[i], ifunc[i])		# Tail call
+		return c + succ_cost(i, itarget[i])
+	}
+	if (m ~ /^br/)
+	{
+		best = next_i ? cost[next_i] : 0
+		alt = 1 + succ_cost(i, itarget[i])
+		return c + ((alt > best) ? alt : best)
+	}
+	if (m ~ /^(cpse|sbrc|sbrs|sbic|sbis)$/)
+	{
+		best = next_i ? cost[next_i] : 0
+		if (next_i)
+		{
+			skip_i = (next_i < ninsn && ifunc[next_i + 1] == ifunc[i]) ? next_i + 1 : 0
+			alt = isize[next_i] / 2 + (skip_i ? cost[skip_i] : 0)
+			if (alt > best)
+				best = alt
+		}
+		return c + best
+	}
+	return c + (next_i ? cost[next_i] : 0)
+}
+
+function succ_cost(i, target,    j)
+{
+	if (!(target in index_of))
+		return 0
+	j = index_of[target]
+	if (iaddr[j] <= iaddr[i])
+	{
+		note[ifunc[i]] = note[ifunc[i]] " loop"
+		return 0
+	}
+	return cost[j]
+}
+
+function callee_cost(name, caller)
+{
+	if (name in wcet)
+	{
+		if (note[name] != "")
+			note[caller] = note[caller] note[name]
+		return wcet[name]
+	}
+	unresolved = 1
+	return 0
+}
+
+# Cost c followed by the path r, -1 (doesn't get to the store) stays -1
+function then(c, r)
+{
+	return (r < 0) ? -1 : c + r
+}
+
+function max(a, b)
+{
+	return (a > b) ? a : b
+}
+
+# Longest path cost from instruction i to the first store to stop_addr, -1 when no path gets there
+function reach_from(i,    m, c, next_i, skip_i, fn, alt)
+{
+	m = imn[i]
+	c = base_cycles(m)
+	next_i = (i < ninsn && ifunc[i + 1] == ifunc[i]) ? i + 1 : 0
+	if (istore[i] == stop_addr && (stop_func == "" || ifunc[i] == stop_func))
+		return c
+	if (m ~ /^(ret|reti|icall|eicall|ijmp|eijmp)$/)
+		return -1
+	if (m == "call" || m == "rcall")
+	{
+		fn = icallee[i]
+		alt = (fn in wcet && next_i) ? then(c + wcet[fn], reach[next_i]) : -1
+		return max(then(c, (fn in reach_fn) ? reach_fn[fn] : -1), alt)
+	}
+	if (m == "jmp" || m == "rjmp")
+	{
+		if (icallee[i] != "" && icallee[i] != ifunc[i])
+			return then(c, (icallee[i] in reach_fn) ? reach_fn[icallee[i]] : -1)
+		return then(c, reach_succ(i, itarget[i]))
+	}
+	if (m ~ /^br/)
+		return then(c, max(next_i ? reach[next_i] : -1, then(1, reach_succ(i, itarget[i]))))
+	if (m ~ /^(cpse|sbrc|sbrs|sbic|sbis)$/)
+	{
+		alt = -1
+		if (next_i)
+		{
+			skip_i = (next_i < ninsn && ifunc[next_i + 1] == ifunc[i]) ? next_i + 1 : 0
+			alt = then(isize[next_i] / 2, skip_i ? reach[skip_i] : -1)
+		}
+		return then(c, max(next_i ? reach[next_i] : -1, alt))
+	}
+	return then(c, next_i ? reach[next_i] : -1)
+}
+
+function reach_succ(i, target,    j)
+{
+	if (!(target in index_of))
+		return -1
+	j = index_of[target]
+	if (iaddr[j] <= iaddr[i])
+	{
+		reach_loop = 1
+		return -1
+	}
+	return reach[j]
+}
+
+function dedup(s,    n, w, i, out, seen)
+{
+	n = split(s, w, " ")
+	out = ""
+	for (i = 1; i <= n; i++)
+		if (!(w[i] in seen))
+		{
+			seen[w[i]] = 1
+			out = out " " w[i]
+		}
+	return out
+}
+
+END {
+	find_stores()
+	# Callees come before their callers after enough passes, the call graph is shallow
+	for (pass = 0; pass < 16; pass++)
+	{
+		unresolved = 0
+		for (i = ninsn; i >= 1; i--)
+			cost[i] = path_from(i)
+		for (k = 1; k <= nfuncs; k++)
+		{
+			fn = funcs[k]
+			if (func_start[fn] in index_of)
+				wcet[fn] = cost[index_of[func_start[fn]]]
+		}
+		if (!unresolved)
+			break
+	}
+	for (k = 1; k <= ntargets; k++)
+	{
+		sym = tsym[k]
+		if (!(sym in wcet) || (tfunc[k] != "" && !(tfunc[k] in wcet)))
+		{
+			printf "%-16s %6s %8s inlined\n", tname[k], "-", "-"
+			continue
+		}
+		if (tstop[k] >= 0)
+		{
+			# Callees first like the worst case, a pass more than the deepest call chain
+			stop_addr = tstop[k]
+			stop_func = tfunc[k]
+			reach_loop = 0
+			delete reach_fn
+			for (pass = 0; pass < 16; pass++)
+			{
+				for (i = ninsn; i >= 1; i--)
+					reach[i] = reach_from(i)
+				for (j = 1; j <= nfuncs; j++)
+				{
+					fn = funcs[j]
+					if (func_start[fn] in index_of)
+						reach_fn[fn] = reach[index_of[func_start[fn]]]
+				}
+			}
+			c = reach_fn[sym]
+			if (c < 0)
+			{
+				printf "%-16s %6s %8s unreached\n", tname[k], "-", "-"
+				continue
+			}
+			if (sym ~ /^__vector_/)
+				c += 5 + 3
+			c += thw[k]
+			printf "%-16s %6d %8.1f%s%s\n", tname[k], c, c * 1e6 / f_cpu, reach_loop ? " loop" : "", thw[k] ? " hw" : ""
+			continue
+		}
+		c = wcet[sym]
+		if (sym ~ /^__vector_/)
+			c += 5 + 3
+		printf "%-16s %6d %8.1f%s\n", tname[k], c, c * 1e6 / f_cpu, dedup(note[sym])
+	}
+}
@@ -0,0 +1,105 @@
+/*
+ * energy.c
+ *
+ *  Energy model of the LED Relay board.
+ *  Currents are typical ATxmega8E5 datasheet values at 3.0 V and 25 C (the LT3014 output), they are a
+ *  starting point for comparing changes, not a replacement for measuring a board. Expect the sleep
+ *  currents to double or triple at high temperature.
+ */
+#include <string.h>
+#include "energy.h"
+
+/*
+ * BOD configuration, must match the fuses in hal_avr.c
+ *  FUSEBYTE5 BODACT is continuous (Active and Idle), FUSEBYTE2 BODPD is sampled (Power-Save and Power-Down)
+ */
+#define BOD_ACTIVE_CONTINUOUS			1
+#define BOD_SLEEP_CONTINUOUS			0
+
+/*
+ * Currents in uA
+ */
+#define MODE_ACTIVE_UA					560.0	// Active, 2 MHz internal RC
+#define MODE_IDLE_UA					150.0	// Idle, 2 MHz internal RC
+#define MODE_PSAVE_UA					0.1		// Power-Save, nothing running (RTC counted separately)
+#define MODE_PDOWN_UA					0.1		// Power-Down, all functions disabled
+#define PERIPH_TC_UA					32.0	// Two 16-bit timer/counters clocked at 2 MHz
+#define MODE_ACTIVE_SLOW_UA				100.0	// Active, 2 MHz internal RC divided by 8
+#define MODE_IDLE_SLOW_UA				30.0	// Idle, 2 MHz internal RC divided by 8
+#define PERIPH_TC_SLOW_UA				4.0		// Two 16-bit timer/counters clocked at 250 kHz
+#define PERIPH_RTC_UA					0.8		// RTC from the 1.024 kHz output of the 32.768 kHz internal RC
+#define PERIPH_WDT_UA					1.0		// Watchdog timer and its 1 kHz ULP oscillator
+#define BOD_CONTINUOUS_UA				138.0	// BOD continuous mode
+#define BOD_SAMPLED_UA					1.2		// BOD sampled mode
+#define REGULATOR_UA					7.0		// LT3014 quiescent current, drawn all the time
+
+#define UAH_FROM_UA_US(x)				((x) / 3.6e9)
+
+enum ENERGY_ITEM { ITEM_TC = 0, ITEM_RTC, ITEM_WDT, ITEM_BOD, ITEM_REGULATOR, ENERGY_ITEMS };
+
+static const char * const mode_names[ENERGY_MODES] = { "Active", "Idle", "Power-Save", "Power-Down" };
+static const char * const item_names[ENERGY_ITEMS] = { "TCC4/TCC5", "RTC", "Watchdog", "BOD", "Regulator" };
+
+static uint64_t mode_time_us[ENERGY_MODES];		// Time spent in each CPU mode
+static double   mode_charge[ENERGY_MODES];		// uA * us drawn by the CPU in each mode
+static double   item_charge[ENERGY_ITEMS];		// uA * us drawn by each peripheral
+
+void energy_reset(void)
+{
+	memset(mode_time_us, 0, sizeof(mode_time_us));
+	memset(mode_charge, 0, sizeof(mode_charge));
+	memset(item_charge, 0, sizeof(item_charge));
+}
+
+/*
+ * Account time_us spent in mode with the periph peripherals running.
+ *  The timers only draw current while their clock runs, which is Active and Idle.
+ */
+void energy_account(uint8_t mode, uint8_t periph, uint64_t time_us)
+{
+	static const double mode_ua[ENERGY_MODES] = { MODE_ACTIVE_UA, MODE_IDLE_UA, MODE_PSAVE_UA, MODE_PDOWN_UA };
+	static const double slow_ua[ENERGY_MODES] = { MODE_ACTIVE_SLOW_UA, MODE_IDLE_SLOW_UA, MODE_PSAVE_UA, MODE_PDOWN_UA };
+	uint8_t awake = (mode == ENERGY_ACTIVE) || (mode == ENERGY_IDLE);
+	uint8_t bod_continuous = awake ? BOD_ACTIVE_CONTINUOUS : BOD_SLEEP_CONTINUOUS;
+	uint8_t slow = periph & ENERGY_CLOCK_SLOW;
+
+	mode_time_us[mode] += time_us;
+	mode_charge[mode] += (slow ? slow_ua[mode] : mode_ua[mode]) * time_us;
+	if (awake && (periph & ENERGY_PERIPH_TC))
+	{
+		item_charge[ITEM_TC] += (slow ? PERIPH_TC_SLOW_UA : PERIPH_TC_UA) * time_us;
+	}
+	if (periph & ENERGY_PERIPH_RTC)
+	{
+		item_charge[ITEM_RTC] += PERIPH_RTC_UA * time_us;
+	}
+	if (periph & ENERGY_PERIPH_WDT)
+	{
+		item_charge[ITEM_WDT] += PERIPH_WDT_UA * time_us;
+	}
+	item_charge[ITEM_BOD] += (bod_continuous ? BOD_CONTINUOUS_UA : BOD_SAMPLED_UA) * time_us;
+	item_charge[ITEM_REGULATOR] += REGULATOR_UA * time_us;
+}
+
+void energy_report(FILE *out)
+{
+	uint64_t total_us = 0;
+	double total = 0.0;
+	uint8_t i;
+
+	fprintf(out, "%-12s %14s %12s\n", "mode", "time_s", "uAh");
+	for (i = 0; i < ENERGY_MODES; i++)
+	{
+		fprintf(out, "%-12s %14.3f %12.4f\n", mode_names[i], mode_time_us[i] / 1e6, UAH_FROM_UA_US(mode_charge[i]));
+		total_us += mode_time_us[i];
+		total += mode_charge[i];
+	}
+	fprintf(out, "%-12s %14s %12s\n", "peripheral", "", "uAh");
+	for (i = 0; i < ENERGY_ITEMS; i++)
+	{
+		fprintf(out, "%-12s %14s %12.4f\n", item_names[i], "", UAH_FROM_UA_US(item_charge[i]));
+		total += item_charge[i];
+	}
+	fprintf(out, "%-12s %14.3f %12.4f\n", "total", total_us / 1e6, UAH_FROM_UA_US(total));
+	fprintf(out, "%-12s %14s %12.3f\n", "average_uA", "", total_us ? total / total_us : 0.0);
+}
@@ -0,0 +1,32 @@
+/*
+ * energy.h
+ *
+ *  Energy model of the LED Relay board. The host HAL reports how long the XMega spends in each CPU mode
+ *  and which clocked peripherals are running, the model integrates the current drawn and reports
+ *  microamp-hours.
+ */
+
+#ifndef ENERGY_H_
+#define ENERGY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * CPU modes
+ */
+enum ENERGY_MODE { ENERGY_ACTIVE = 0, ENERGY_IDLE, ENERGY_PSAVE, ENERGY_PDOWN, ENERGY_MODES };
+
+/*
+ * Peripherals that draw current on top of the CPU mode
+ */
+#define ENERGY_PERIPH_TC				0x01	// TCC4 and TCC5 running from the 2 MHz clock
+#define ENERGY_PERIPH_RTC				0x02	// RTC and the 32.768 kHz internal RC oscillator
+#define ENERGY_PERIPH_WDT				0x04	// Watchdog timer
+#define ENERGY_CLOCK_SLOW				0x08	// System clock divided by HAL_CLOCK_SLOW_DIV, Active, Idle and the timers draw less
+
+void energy_reset(void);
+void energy_account(uint8_t mode, uint8_t periph, uint64_t time_us);
+void energy_report(FILE *out);
+
+#endif /* ENERGY_H_ */
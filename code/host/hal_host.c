@@ -0,0 +1,423 @@
+/*
+ * hal_host.c
+ *
+ *  Host implementation of the LED Relay HAL.
+ *  The ACC inputs behave like the ATxmega8E5 ISRs: any edge restarts the de-bounce time and reports an
+ *  OFF input as ON immediately, the input is only reported OFF when it is still OFF at the end of the
+ *  de-bounce time. With HAL_DEBOUNCE_FILTER an input is reported ON or OFF only once it has been stable for
+ *  the de-bounce time, and the CPU stays in Idle Mode while an edge is in the filters. HAL_DEBOUNCE_VERTICAL
+ *  behaves the same, with the edge time of the first stable sample instead of the end of the de-bounce
+ *  time. With HAL_OUTPUT_XCL outputs set with HAL_OUTPUT_FOLLOW are ON while both reported inputs are ON,
+ *  like the lookup tables.
+ *  Without either de-bounce option an edge that wakes the CPU from the deeper modes with both inputs ON
+ *  sets the outputs armed with hal_outputs_wake(), like the input sense ISRs.
+ *  Every ms that passes is handed to the energy model with the CPU mode and the peripherals running.
+ */
+#include <assert.h>
+#include <string.h>
+#include "hal_host.h"
+#include "energy.h"
+#include "config.h"
+
+#define EVENT_QUEUE_SIZE				64		// Must be a power of 2
+#define STABLE_ONLY						(HAL_DEBOUNCE_FILTER || HAL_DEBOUNCE_VERTICAL)	// No immediate ON
+
+typedef struct
+{
+	uint8_t  raw;								// Level driven by the test
+	uint8_t  last;								// Level reported to the relay logic
+	uint8_t  debounce;							// De-bounce time is running
+	uint32_t debounce_ms;						// End of the de-bounce time
+} host_input_t;
+
+static uint32_t host_ms;						// Virtual ms timebase
+static uint8_t  debounce_ms;					// De-bounce time
+static host_input_t inputs[ACC_INPUTS];
+static acc_event_t event_queue[EVENT_QUEUE_SIZE];
+static uint8_t  event_head;
+static uint8_t  event_tail;
+static uint8_t  outputs;
+static uint8_t  wake_outputs;					// Armed by hal_outputs_wake() for the current sleep
+static uint8_t  eeprom[HOST_EEPROM_SIZE];
+static uint8_t  timer_running;					// Bit per Stay ON timer
+static uint8_t  timer_expired;					// Bit per Stay ON timer
+static uint32_t timer_deadline_ms[HAL_TIMERS];
+static uint8_t  rtc_users;						// Like the AVR power_users[POWER_RTC], one while any timer is started
+static uint8_t  slept;							// hal_sleep() would have slept since the last host_slept()
+static uint8_t  sleep_mode;
+static uint8_t  wake_armed;						// The current sleep ends at wake_ms
+static uint32_t wake_ms;
+static uint8_t  asleep;							// The CPU is in sleep_mode until something wakes it
+static uint8_t  tc_running;						// TCC4 and TCC5 have been started by hal_init()
+static uint8_t  wdt_enabled;
+static uint8_t  clock_slow;						// hal_clock_slow() allows the slow clock
+static uint8_t  sleep_wdt_enabled;				// Watchdog state when the CPU went to sleep
+static uint64_t active_us;						// Active time not accounted yet
+
+static void event_push(uint8_t input, uint8_t level, uint32_t tick_ms)
+{
+	uint8_t next = (event_head + 1) & (EVENT_QUEUE_SIZE - 1);
+
+	if (next == event_tail)
+	{
+		// The queue is much deeper than the AVR one, a test that fills it is broken
+		return;
+	}
+	event_queue[event_head].input = input;
+	event_queue[event_head].level = level;
+	event_queue[event_head].tick_ms = tick_ms;
+	event_head = next;
+}
+
+void host_reset(void)
+{
+	host_ms = 0;
+	debounce_ms = CONFIG_DEBOUNCE_MS;
+	memset(inputs, 0, sizeof(inputs));
+	event_head = event_tail = 0;
+	outputs = 0;
+	wake_outputs = 0;
+	memset(eeprom, 0xFF, sizeof(eeprom));		// Erased EEPROM
+	timer_running = timer_expired = 0;
+	rtc_users = 0;
+	slept = FALSE;
+	sleep_mode = HAL_SLEEP_IDLE;
+	wake_armed = FALSE;
+	asleep = FALSE;
+	tc_running = FALSE;
+	wdt_enabled = FALSE;
+	clock_slow = FALSE;
+	active_us = 0;
+	energy_reset();
+}
+
+void host_input_set(uint8_t input, uint8_t level)
+{
+	host_input_t *in = &inputs[input];
+
+	// Any edge restarts the de-bounce time
+	if (level != in->raw)
+	{
+		in->raw = level;
+#if !STABLE_ONLY
+		if (asleep && (sleep_mode != HAL_SLEEP_IDLE) && wake_outputs && inputs[ACC1_INPUT].raw && inputs[ACC2_INPUT].raw)
+		{
+			// Wake up fast path of the input sense ISRs
+			outputs = wake_outputs;
+		}
+#endif
+		wake_outputs = 0;
+		asleep = FALSE;							// The input sense interrupt wakes the CPU
+		in->debounce = TRUE;
+		in->debounce_ms = host_ms + debounce_ms;
+#if !STABLE_ONLY
+		if (!in->last)
+		{
+			in->last = ON;
+			event_push(input, ON, host_ms);
+		}
+#endif
+	}
+}
+
+/*
+ * Account the time until tick_ms, the pending active time first and the rest in the current CPU mode.
+ */
+static void energy_update(uint32_t tick_ms)
+{
+	static const uint8_t sleep_modes[] = { ENERGY_IDLE, ENERGY_PSAVE, ENERGY_PDOWN };
+	uint64_t time_us = (uint64_t) (tick_ms - host_ms) * 1000;
+	uint64_t run_us = (active_us < time_us) ? active_us : time_us;
+	uint8_t periph = 0;
+
+	if (tc_running)
+	{
+		periph |= ENERGY_PERIPH_TC;
+	}
+	if (timer_running)
+	{
+		periph |= ENERGY_PERIPH_RTC;
+	}
+	// hal_sleep() returns at once on the host, the watchdog state it slept with is the one that counts
+	if (asleep ? sleep_wdt_enabled : wdt_enabled)
+	{
+		periph |= ENERGY_PERIPH_WDT;
+	}
+	if (clock_slow)
+	{
+		periph |= ENERGY_CLOCK_SLOW;
+	}
+	energy_account(ENERGY_ACTIVE, periph, run_us);
+	energy_account(asleep ? sleep_modes[sleep_mode] : ENERGY_ACTIVE, periph, time_us - run_us);
+	active_us -= run_us;
+}
+
+/*
+ * Move the virtual time forward to tick_ms, handling every de-bounce and Stay ON timeout on the way.
+ */
+void host_advance(uint32_t tick_ms)
+{
+	uint8_t i;
+
+	energy_update(tick_ms);
+
+	for (i = ACC1_INPUT; i < ACC_INPUTS; i++)
+	{
+		host_input_t *in = &inputs[i];
+
+		if (in->debounce && ((int32_t) (tick_ms - in->debounce_ms) >= 0))
+		{
+			in->debounce = FALSE;
+			if (in->last != in->raw)
+			{
+				in->last = in->raw;
+				event_push(i, in->last, in->debounce_ms - (HAL_DEBOUNCE_VERTICAL ? debounce_ms : 0));
+			}
+		}
+	}
+	for (i = 0; i < HAL_TIMERS; i++)
+	{
+		if ((timer_running & (1 << i)) && ((int32_t) (tick_ms - timer_deadline_ms[i]) >= 0))
+		{
+			timer_running &= ~(1 << i);
+			timer_expired |= 1 << i;
+		}
+	}
+	// Whatever made time move also ended the sleep, the relay logic sets a new deadline before it sleeps again
+	wake_armed = FALSE;
+	wake_outputs = 0;
+	asleep = FALSE;
+	host_ms = tick_ms;
+}
+
+/*
+ * The relay logic ran for time_us at full speed, it is accounted as Active at the start of the next interval.
+ */
+void host_active(uint32_t time_us)
+{
+	active_us += clock_slow ? time_us * HAL_CLOCK_SLOW_DIV : time_us;
+}
+
+/*
+ * Return the earliest time something happens without an ACC change: a de-bounce time ending, a Stay ON
+ *  timer expiring or the Idle wake up deadline. HAL_NO_DEADLINE when there is nothing to wait for.
+ */
+uint32_t host_next_deadline(void)
+{
+	uint32_t next = HAL_NO_DEADLINE;
+	uint8_t i;
+
+	for (i = ACC1_INPUT; i < ACC_INPUTS; i++)
+	{
+		if (inputs[i].debounce && ((inputs[i].debounce_ms - host_ms) < (next - host_ms)))
+		{
+			next = inputs[i].debounce_ms;
+		}
+	}
+	for (i = 0; i < HAL_TIMERS; i++)
+	{
+		if ((timer_running & (1 << i)) && ((timer_deadline_ms[i] - host_ms) < (next - host_ms)))
+		{
+			next = timer_deadline_ms[i];
+		}
+	}
+	if (wake_armed && ((wake_ms - host_ms) < (next - host_ms)))
+	{
+		next = wake_ms;
+	}
+	return next;
+}
+
+uint32_t host_time(void)
+{
+	return host_ms;
+}
+
+uint8_t host_outputs_get(void)
+{
+#if HAL_OUTPUT_XCL
+	if (outputs & HAL_OUTPUT_FOLLOW)
+	{
+		return (inputs[ACC1_INPUT].last && inputs[ACC2_INPUT].last) ? (HAL_OUTPUT_V1 | HAL_OUTPUT_V2) : 0;
+	}
+#endif
+	return outputs & (HAL_OUTPUT_V1 | HAL_OUTPUT_V2);
+}
+
+uint8_t host_slept(void)
+{
+	uint8_t result = slept;
+
+	slept = FALSE;
+	return result;
+}
+
+uint8_t host_sleep_mode(void)
+{
+	return sleep_mode;
+}
+
+void hal_init(void)
+{
+	outputs = 0;
+	tc_running = TRUE;
+}
+
+uint8_t hal_input_get(uint8_t input)
+{
+	return inputs[input].last;
+}
+
+uint8_t hal_event_get(acc_event_t *event)
+{
+	if (event_tail == event_head)
+	{
+		return FALSE;
+	}
+	*event = event_queue[event_tail];
+	event_tail = (event_tail + 1) & (EVENT_QUEUE_SIZE - 1);
+	return TRUE;
+}
+
+void hal_debounce_set(uint8_t ms)
+{
+	debounce_ms = ms;
+}
+
+void hal_outputs_set(uint8_t value)
+{
+	outputs = value;
+}
+
+void hal_outputs_wake(uint8_t value)
+{
+	wake_outputs = value;
+}
+
+/*
+ * The ramp only changes how fast an output reaches full power, the host reports it ON from the start.
+ */
+void hal_ramp_set(uint16_t ms)
+{
+	(void) ms;
+}
+
+/*
+ * Same for the fade, the host reports the output OFF when the fade starts.
+ */
+void hal_fade_set(uint16_t ms)
+{
+	(void) ms;
+}
+
+/*
+ * The host has no ramps to wait for, the slow clock only changes the energy model.
+ */
+void hal_clock_slow(uint8_t slow)
+{
+	clock_slow = slow;
+}
+
+uint32_t hal_clock_ms(void)
+{
+	return host_ms;
+}
+
+/*
+ * A timer is started from hal_timer_start() until hal_timer_stop(), expired or not. The RTC is acquired
+ *  by the first started timer and released by the last one like on the AVR, a release without a user
+ *  would leave the RTC unpowered at the next start there.
+ */
+void hal_timer_start(uint8_t timer, uint8_t minutes)
+{
+	if (!(timer_running | timer_expired))
+	{
+		rtc_users++;
+	}
+	timer_running |= 1 << timer;
+	timer_expired &= ~(1 << timer);
+	timer_deadline_ms[timer] = host_ms + (uint32_t) minutes * 60 * 1000;
+}
+
+void hal_timer_stop(uint8_t timer)
+{
+	if (!((timer_running | timer_expired) & (1 << timer)))
+	{
+		return;
+	}
+	timer_running &= ~(1 << timer);
+	timer_expired &= ~(1 << timer);
+	if (!(timer_running | timer_expired))
+	{
+		assert(rtc_users == 1);
+		rtc_users--;
+	}
+}
+
+uint8_t hal_timer_expired(uint8_t timer)
+{
+	return (timer_expired >> timer) & 1;
+}
+
+const uint8_t *hal_nvm_map(uint16_t addr)
+{
+	return &eeprom[addr];
+}
+
+void hal_nvm_write(uint16_t addr, const uint8_t *data, uint8_t len)
+{
+	while (len--)
+	{
+		if (addr < HOST_EEPROM_SIZE)
+		{
+			eeprom[addr] = *data;
+		}
+		addr++;
+		data++;
+	}
+}
+
+/*
+ * Nothing to wait for on the host, only record that the relay logic would have slept and when it would
+ *  wake up. Like the AVR it doesn't sleep when an event is pending or the deadline is too close.
+ */
+void hal_sleep(uint8_t mode, uint32_t wait_ms)
+{
+	uint8_t i;
+
+	if ((wait_ms < 2) || (event_head != event_tail) || timer_expired)
+	{
+		return;
+	}
+	for (i = ACC1_INPUT; i < ACC_INPUTS; i++)
+	{
+		if (inputs[i].debounce)
+		{
+			// The de-bounce stops in the deeper modes, host_next_deadline() ends the sleep when it is over
+			mode = HAL_SLEEP_IDLE;
+		}
+	}
+	slept = TRUE;
+	asleep = TRUE;
+	sleep_mode = mode;
+	sleep_wdt_enabled = wdt_enabled;
+	if (wait_ms != HAL_NO_DEADLINE)
+	{
+		wake_armed = TRUE;
+		wake_ms = host_ms + wait_ms;
+	}
+}
+
+void hal_wdt_enable(void)
+{
+	wdt_enabled = TRUE;
+}
+
+void hal_wdt_disable(void)
+{
+	wdt_enabled = FALSE;
+}
+
+void hal_wdt_reset(void)
+{
+}
@@ -0,0 +1,27 @@
+/*
+ * hal_host.h
+ *
+ *  Host implementation of the LED Relay HAL. Time is virtual and only moves when host_advance() is
+ *  called, the ACC inputs are driven with host_input_set() and the outputs are read back with
+ *  host_outputs_get(). host_next_deadline() tells a discrete-event driver how far it can jump.
+ */
+
+#ifndef HAL_HOST_H_
+#define HAL_HOST_H_
+
+#include <stdint.h>
+#include "hal.h"
+
+#define HOST_EEPROM_SIZE				512		// ATxmega8E5 EEPROM size
+
+void     host_reset(void);
+void     host_input_set(uint8_t input, uint8_t level);
+void     host_advance(uint32_t tick_ms);
+uint32_t host_next_deadline(void);
+void     host_active(uint32_t time_us);
+uint32_t host_time(void);
+uint8_t  host_outputs_get(void);
+uint8_t  host_slept(void);
+uint8_t  host_sleep_mode(void);
+
+#endif /* HAL_HOST_H_ */
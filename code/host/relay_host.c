@@ -0,0 +1,142 @@
+/*
+ * relay_host.c
+ *
+ *  Discrete-event simulator for the LED Relay logic. Reads a timeline from stdin, one change per line:
+ *
+ *    <ms> ACC<n> <0|1>		n is 1 to ACC_INPUTS
+ *    <ms> END
+ *
+ *  Times must not decrease, '#' starts a comment. Every output change is printed as "<ms> V1=<0|1> V2=<0|1>".
+ *
+ *  The virtual clock never ticks, it jumps straight to whatever happens next: the next timeline change, a
+ *  de-bounce time ending, the Stay ON timer expiring or the Idle wake up deadline. relay_step() runs the
+ *  same as the main loop on the XMega, once per wake up, so a 250 minute Stay ON costs a handful of steps.
+ *  With -s the number of steps, the virtual time and the wall time are printed to stderr at the end. With
+ *  -e the energy used by the board over the timeline is printed at the end (see energy.c).
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "hal_host.h"
+#include "energy.h"
+#include "relay.h"
+
+#define MAX_STEPS_PER_WAKE				8		// relay_step() calls before time moves without a sleep
+#define STEP_ACTIVE_US					250		// Active time of one relay_step(), about 500 cycles at 2 MHz
+
+static uint8_t  slept;							// The relay logic is sleeping until the next deadline
+static uint8_t  last_outputs;					// Last printed outputs
+static unsigned long steps;						// relay_step() calls so far
+
+/*
+ * Run the relay logic after a wake up until it goes back to sleep, then print any output change.
+ */
+static void wake(void)
+{
+	uint8_t count;
+	uint8_t now;
+
+	slept = FALSE;
+	for (count = 0; count < MAX_STEPS_PER_WAKE; count++)
+	{
+		relay_step();
+		host_active(STEP_ACTIVE_US);
+		steps++;
+		if (host_slept())
+		{
+			slept = TRUE;
+			break;
+		}
+	}
+	now = host_outputs_get();
+	if (now != last_outputs)
+	{
+		printf("%lu V1=%d V2=%d\n", (unsigned long) host_time(), !!(now & HAL_OUTPUT_V1), !!(now & HAL_OUTPUT_V2));
+		last_outputs = now;
+	}
+}
+
+/*
+ * Jump from deadline to deadline until end_ms.
+ */
+static void run_until(uint32_t end_ms)
+{
+	uint32_t next;
+
+	while (host_time() < end_ms)
+	{
+		// A relay_step() that didn't sleep is polling, let 1 ms pass like a short Idle
+		next = slept ? host_next_deadline() : host_time() + 1;
+		if ((next - host_time()) > (end_ms - host_time()))
+		{
+			next = end_ms;
+		}
+		host_advance(next);
+		wake();
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	char line[128];
+	char name[16];
+	unsigned long ms;
+	int level;
+	int fields;
+	int input;
+	uint32_t line_no = 0;
+	uint8_t stats = FALSE;
+	uint8_t energy = FALSE;
+	struct timespec start, end;
+
+	while (--argc > 0)
+	{
+		stats |= !strcmp(argv[argc], "-s");
+		energy |= !strcmp(argv[argc], "-e");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	host_reset();
+	relay_init();
+	wake();
+	while (fgets(line, sizeof(line), stdin))
+	{
+		line_no++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		fields = sscanf(line, "%lu %15s %d", &ms, name, &level);
+		if (fields <= 0)
+		{
+			continue;
+		}
+		if ((fields < 2) || (ms < host_time()))
+		{
+			fprintf(stderr, "line %lu: bad change\n", (unsigned long) line_no);
+			return EXIT_FAILURE;
+		}
+		run_until(ms);
+		if (!strcmp(name, "END"))
+		{
+			break;
+		}
+		input = strncmp(name, "ACC", 3) ? 0 : atoi(&name[3]);
+		if ((fields != 3) || (input < 1) || (input > ACC_INPUTS))
+		{
+			fprintf(stderr, "line %lu: bad change\n", (unsigned long) line_no);
+			return EXIT_FAILURE;
+		}
+		// The input sense interrupt wakes the relay logic
+		host_input_set(ACC1_INPUT + input - 1, level ? ON : OFF);
+		wake();
+	}
+	if (stats)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		fprintf(stderr, "steps=%lu virtual_ms=%lu wall_us=%.1f\n", steps, (unsigned long) host_time(),
+				(end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3);
+	}
+	if (energy)
+	{
+		energy_report(stdout);
+	}
+	return EXIT_SUCCESS;
+}